@@ -0,0 +1,147 @@
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+#include "efp/logger.hpp"
+
+// Measures the backend cost per record by draining a standalone LogBuffer into /dev/null.
+// No Logger is created, so the queue of this thread belongs to the LogBuffer.
+
+template <typename F>
+double drain_ns_per_record(efp::detail::LogBuffer& log_buffer, int num_record, const F& log) {
+    double ns_per_record = 0;
+
+    // The first round warms up the queue and the caches of the backend
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < num_record; ++i) {
+            log(log_buffer, i);
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        log_buffer.calibrate_time();
+        log_buffer.snapshot();
+        while (!log_buffer.empty()) {
+            log_buffer.dequeue_with_time();
+        }
+        log_buffer.flush_output();
+
+        const auto end = std::chrono::steady_clock::now();
+        ns_per_record = std::chrono::duration<double, std::nano>(end - start).count() / num_record;
+    }
+
+    return ns_per_record;
+}
+
+// Drains through drain(), which splits the formatting across the threads of the pool
+template <typename F>
+double drain_ns_per_record_parallel(efp::detail::LogBuffer& log_buffer, int num_record,
+                                    const F& log) {
+    double ns_per_record = 0;
+
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < num_record; ++i) {
+            log(log_buffer, i);
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        log_buffer.calibrate_time();
+        log_buffer.snapshot();
+        while (log_buffer.drain(efp::detail::drain_quota, true)) {
+        }
+        log_buffer.flush_output();
+
+        const auto end = std::chrono::steady_clock::now();
+        ns_per_record = std::chrono::duration<double, std::nano>(end - start).count() / num_record;
+    }
+
+    return ns_per_record;
+}
+
+int main() {
+    using namespace efp;
+
+    const int num_record = 200000;
+
+    FILE* null_file = fopen("/dev/null", "w");
+    if (!null_file) {
+        printf("Can not open /dev/null\n");
+        return 1;
+    }
+
+    detail::LogBuffer log_buffer;
+    LoggerConfig config;
+    config.queue_capacity = 1 << 26;
+    log_buffer.set_config(config);
+    log_buffer.set_output_file(null_file);
+
+    const std::string short_string = "short string";
+
+    printf("Backend cost per record\n");
+
+    printf("  no argument:        %.1f ns\n",
+           drain_ns_per_record(log_buffer, num_record, [](detail::LogBuffer& b, int) {
+               b.enqueue(LogLevel::Info, "Logging message without argument");
+           }));
+
+    printf("  int:                %.1f ns\n",
+           drain_ns_per_record(log_buffer, num_record, [](detail::LogBuffer& b, int i) {
+               b.enqueue(LogLevel::Info, "Logging message number: {}", i);
+           }));
+
+    printf("  int, double, cstr:  %.1f ns\n",
+           drain_ns_per_record(log_buffer, num_record, [](detail::LogBuffer& b, int i) {
+               b.enqueue(LogLevel::Info, "Logging {} {:.3f} {}", i, i * 0.5, "literal");
+           }));
+
+    printf("  std::string:        %.1f ns\n",
+           drain_ns_per_record(log_buffer, num_record, [&](detail::LogBuffer& b, int i) {
+               b.enqueue(LogLevel::Info, "Logging {} {}", short_string, i);
+           }));
+
+    printf("  int, double fields: %.1f ns\n",
+           drain_ns_per_record(log_buffer, num_record, [](detail::LogBuffer& b, int i) {
+               b.enqueue(LogLevel::Info, "order filled", kv("id", i), kv("px", i * 0.5));
+           }));
+
+    log_buffer.set_output_format(OutputFormat::Json);
+
+    printf("  fields as JSON:     %.1f ns\n",
+           drain_ns_per_record(log_buffer, num_record, [](detail::LogBuffer& b, int i) {
+               b.enqueue(LogLevel::Info, "order filled", kv("id", i), kv("px", i * 0.5));
+           }));
+
+    log_buffer.set_output_format(OutputFormat::Text);
+
+    // Further sinks copy the formatted body instead of formatting it again
+    log_buffer.add_sink(std::make_shared<FileSink>(null_file));
+    log_buffer.add_sink(std::make_shared<FileSink>(null_file));
+
+    printf("  int, three sinks:   %.1f ns\n",
+           drain_ns_per_record(log_buffer, num_record, [](detail::LogBuffer& b, int i) {
+               b.enqueue(LogLevel::Info, "Logging message number: {}", i);
+           }));
+
+    log_buffer.set_sink(std::make_shared<FileSink>(null_file));
+
+    // LoggerConfig::format_threads, with output identical to one thread
+    detail::FormatPool format_pool;
+    log_buffer.set_format_pool(format_pool);
+
+    printf("Backend cost per record with format threads, int, double, cstr\n");
+
+    const unsigned max_threads = std::thread::hardware_concurrency() < 8
+                                     ? std::thread::hardware_concurrency()
+                                     : 8;
+    for (unsigned thread_num = 1; thread_num <= max_threads; thread_num *= 2) {
+        format_pool.set_thread_num(thread_num);
+        printf("  %u threads:          %.1f ns\n", thread_num,
+               drain_ns_per_record_parallel(log_buffer, num_record, [](detail::LogBuffer& b, int i) {
+                   b.enqueue(LogLevel::Info, "Logging {} {:.3f} {}", i, i * 0.5, "literal");
+               }));
+    }
+
+    fclose(null_file);
+    return 0;
+}
@@ -1,38 +1,339 @@
-#include <vector>
-#include <iostream>
+// Producer latency and end-to-end throughput of the logger.
+// Usage: efp_logger_benchmark [max_threads] [log_file]
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "efp/logger.hpp"
 
-int main()
-{
-    const int num_message = 1000000; // Number of messages to log for the benchmark
+using namespace efp;
+
+namespace {
+    // Time stamp counter where available, nanoseconds otherwise
+    inline uint64_t cycles() {
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+
+    double measure_cycles_per_ns() {
+        const auto start = std::chrono::steady_clock::now();
+        const uint64_t start_cycles = cycles();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const uint64_t end_cycles = cycles();
+        const auto end = std::chrono::steady_clock::now();
+
+        return (end_cycles - start_cycles) /
+               std::chrono::duration<double, std::nano>(end - start).count();
+    }
+
+    // Counts the lines on their way to the target, to tell what the backend has written
+    class CountingSink : public Sink {
+    public:
+        CountingSink(std::shared_ptr<Sink> target, LogLevel level)
+            : Sink(level, false), _target(std::move(target)), _lines(0) {}
+
+        void write(const char* data, size_t size) override {
+            uint64_t lines = 0;
+            const char* end = data + size;
+            for (const char* it = data; (it = static_cast<const char*>(
+                                             std::memchr(it, '\n', end - it))) != nullptr;
+                 ++it) {
+                ++lines;
+            }
+            _lines.fetch_add(lines, std::memory_order_relaxed);
+
+            if (_target) {
+                _target->write(data, size);
+            }
+        }
+
+        uint64_t lines() const { return _lines.load(std::memory_order_relaxed); }
+
+    private:
+        std::shared_ptr<Sink> _target;
+        std::atomic<uint64_t> _lines;
+    };
+
+    // Routes the output to the target and tells apart records from the drop reports
+    class Output {
+    public:
+        explicit Output(std::shared_ptr<Sink> target)
+            : _records(std::make_shared<CountingSink>(std::move(target), LogLevel::Trace)),
+              _reports(std::make_shared<CountingSink>(nullptr, LogLevel::Warn)),
+              _written_base(0),
+              _dropped_base(Logger::dropped_count()) {
+            Logger::set_sink(_records);
+            Logger::add_sink(_reports);
+        }
+
+        struct Result {
+            uint64_t written;
+            uint64_t dropped;
+            uint64_t lost;
+        };
+
+        // Waits until every record is written or counted as dropped, for at most timeout
+        Result wait(uint64_t expected, std::chrono::seconds timeout) {
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            Result result{};
+            while (true) {
+                result.written = _records->lines() - _reports->lines() - _written_base;
+                result.dropped = Logger::dropped_count() - _dropped_base;
+                if (result.written + result.dropped >= expected ||
+                    std::chrono::steady_clock::now() > deadline) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            result.lost = expected - std::min(expected, result.written + result.dropped);
+
+            _written_base += result.written;
+            _dropped_base += result.dropped;
+            return result;
+        }
+
+    private:
+        std::shared_ptr<CountingSink> _records;
+        std::shared_ptr<CountingSink> _reports;
+        uint64_t _written_base;
+        uint64_t _dropped_base;
+    };
+
+    // Starts the threads together and returns when all are done
+    template <typename F>
+    void run_threads(int thread_num, const F& f) {
+        std::atomic<bool> start{false};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_num; ++t) {
+            threads.emplace_back([&, t]() {
+                while (!start.load(std::memory_order_acquire)) {
+                }
+                f(t);
+            });
+        }
+        start.store(true, std::memory_order_release);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    template <typename F>
+    void latency(Output& output, double cycles_per_ns, const char* name, int thread_num,
+                 int call_num, const F& log) {
+        std::vector<std::vector<uint64_t>> samples(thread_num, std::vector<uint64_t>(call_num));
+
+        run_threads(thread_num, [&](int t) {
+            std::vector<uint64_t>& thread_samples = samples[t];
+            for (int i = 0; i < call_num; ++i) {
+                const uint64_t start = cycles();
+                log(i);
+                thread_samples[i] = cycles() - start;
+            }
+        });
+
+        std::vector<uint64_t> all;
+        all.reserve(static_cast<size_t>(thread_num) * call_num);
+        for (const auto& thread_samples : samples) {
+            all.insert(all.end(), thread_samples.begin(), thread_samples.end());
+        }
+        std::sort(all.begin(), all.end());
+
+        auto percentile = [&](double p) {
+            const size_t i = std::min(all.size() - 1, static_cast<size_t>(p * all.size()));
+            return all[i] / cycles_per_ns;
+        };
+
+        const Output::Result result =
+            output.wait(static_cast<uint64_t>(thread_num) * call_num, std::chrono::seconds(10));
+
+        printf("%-14s %7d %8.0f %8.0f %8.0f %10.0f %10llu %10llu %6llu\n", name, thread_num,
+               percentile(0.5), percentile(0.99), percentile(0.999), all.back() / cycles_per_ns,
+               static_cast<unsigned long long>(result.written),
+               static_cast<unsigned long long>(result.dropped),
+               static_cast<unsigned long long>(result.lost));
+    }
 
-    // efp::Logger::log_level = efp::LogLevel::Fatal;
+    // Median latency of the first call on a new thread, which makes the queue of the thread
+    // unless it is prepared
+    void first_call(Output& output, double cycles_per_ns, const char* name, bool prepared) {
+        const int thread_num = 21;
+        std::vector<uint64_t> samples(thread_num);
 
-    // Start timer
-    auto start = std::chrono::high_resolution_clock::now();
+        for (int t = 0; t < thread_num; ++t) {
+            std::thread thread([&]() {
+                if (prepared) {
+                    Logger::prepare_thread();
+                }
+                const uint64_t start = cycles();
+                info("First message of thread {}", t);
+                samples[t] = cycles() - start;
+            });
+            thread.join();
+        }
+        std::sort(samples.begin(), samples.end());
 
-    // Logger messages in a loop
-    for (int i = 0; i < num_message; ++i)
+        const Output::Result result = output.wait(thread_num, std::chrono::seconds(10));
+
+        printf("%-24s %10.0f %10.0f %10llu %10llu %6llu\n", name,
+               samples[thread_num / 2] / cycles_per_ns, samples.back() / cycles_per_ns,
+               static_cast<unsigned long long>(result.written),
+               static_cast<unsigned long long>(result.dropped),
+               static_cast<unsigned long long>(result.lost));
+    }
+
+    void throughput(const char* name, std::shared_ptr<Sink> target, int thread_num,
+                    int record_num) {
+        Output output{std::move(target)};
+        const int per_thread = record_num / thread_num;
+        const uint64_t expected = static_cast<uint64_t>(per_thread) * thread_num;
+
+        const auto start = std::chrono::steady_clock::now();
+        run_threads(thread_num, [&](int) {
+            for (int i = 0; i < per_thread; ++i) {
+                info("Logging message number: {} {}", i, 0.5 * i);
+            }
+        });
+        const auto enqueued = std::chrono::steady_clock::now();
+        const Output::Result result = output.wait(expected, std::chrono::seconds(60));
+        const auto end = std::chrono::steady_clock::now();
+
+        const double producer_s = std::chrono::duration<double>(enqueued - start).count();
+        const double total_s = std::chrono::duration<double>(end - start).count();
+
+        printf("%-10s %7d %10.3f %10.3f %12.0f %10llu %10llu %6llu\n", name, thread_num,
+               producer_s, total_s, result.written / total_s,
+               static_cast<unsigned long long>(result.written),
+               static_cast<unsigned long long>(result.dropped),
+               static_cast<unsigned long long>(result.lost));
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    const unsigned hardware_threads = std::thread::hardware_concurrency();
+    const int max_threads =
+        argc > 1 ? std::atoi(argv[1]) : static_cast<int>(hardware_threads > 1 ? hardware_threads : 2);
+    const char* log_path = argc > 2 ? argv[2] : "./efp_logger_benchmark.log";
+
+    std::FILE* null_file = std::fopen("/dev/null", "w");
+    if (!null_file) {
+        printf("Can not open /dev/null\n");
+        return 1;
+    }
+
+    std::vector<int> thread_nums;
+    for (int n = 1; n < max_threads; n *= 2) {
+        thread_nums.push_back(n);
+    }
+    thread_nums.push_back(max_threads);
+
+    const double cycles_per_ns = measure_cycles_per_ns();
+    uint64_t timer_overhead = ~0ull;
+    for (int i = 0; i < 1000; ++i) {
+        const uint64_t start = cycles();
+        timer_overhead = std::min(timer_overhead, cycles() - start);
+    }
+
+    // Producer latency. Queues are large enough that drops show a backend falling behind.
+    // The logger and the queue of this thread are made up front.
     {
-        efp::info("Logging message number: {}", i);
+        LoggerConfig config;
+        config.queue_capacity = 1 << 20;
+        Logger::init(config);
+        Output output{std::make_shared<FileSink>(null_file)};
+
+        const int call_num = 100000;
+        const std::string short_string = "short string";
+        const std::string long_string(256, 'x');
+
+        printf("Producer latency in ns, %d calls per thread, timer overhead %.0f ns\n", call_num,
+               timer_overhead / cycles_per_ns);
+        printf("%-14s %7s %8s %8s %8s %10s %10s %10s %6s\n", "arguments", "threads", "p50", "p99",
+               "p99.9", "max", "written", "dropped", "lost");
+
+        for (const int thread_num : thread_nums) {
+            latency(output, cycles_per_ns, "none", thread_num, call_num,
+                    [](int) { info("Logging message without argument"); });
+            latency(output, cycles_per_ns, "int", thread_num, call_num,
+                    [](int i) { info("Logging message number: {}", i); });
+            latency(output, cycles_per_ns, "int (macro)", thread_num, call_num,
+                    [](int i) { EFP_LOG_INFO("Logging message number: {}", i); });
+            latency(output, cycles_per_ns, "double", thread_num, call_num,
+                    [](int i) { info("Logging a double: {}", i * 0.5); });
+            latency(output, cycles_per_ns, "const char*", thread_num, call_num,
+                    [](int) { info("Logging a literal: {}", "literal"); });
+            latency(output, cycles_per_ns, "short string", thread_num, call_num,
+                    [&](int) { info("Logging a string: {}", short_string); });
+            latency(output, cycles_per_ns, "long string", thread_num, call_num,
+                    [&](int) { info("Logging a string: {}", long_string); });
+            latency(output, cycles_per_ns, "mixed", thread_num, call_num, [&](int i) {
+                info("Logging {} {} {} {}", i, i * 0.5f, "literal", short_string);
+            });
+        }
     }
 
-    // Wait for all messages to be processed
-    std::this_thread::sleep_for(std::chrono::seconds(1));
+    // The first call on a new thread against the steady state above
+    {
+        LoggerConfig config;
+        config.queue_capacity = 1 << 20;
+        Logger::set_config(config);
+        Output output{std::make_shared<FileSink>(null_file)};
+
+        printf("\nFirst call on a new thread in ns, %d KiB queue\n",
+               static_cast<int>(config.queue_capacity >> 10));
+        printf("%-24s %10s %10s %10s %10s %6s\n", "queue", "median", "max", "written", "dropped",
+               "lost");
 
-    // Stop timer
-    auto end = std::chrono::high_resolution_clock::now();
+        first_call(output, cycles_per_ns, "made by the call", false);
+        first_call(output, cycles_per_ns, "prepare_thread()", true);
 
-    // Calculate and print the duration
-    std::chrono::duration<double> duration = end - start;
-    double total_seconds = duration.count() - 1; // Subtracting the sleep time
-    double messages_per_second = num_message / total_seconds;
+        config.lock_queue_memory = true;
+        Logger::set_config(config);
+        first_call(output, cycles_per_ns, "prepared and locked", true);
+    }
 
-    std::cout << "Logged " << num_message << " messages in " << total_seconds << " seconds.\n";
-    std::cout << "Average time per message: " << (total_seconds / num_message) << " seconds.\n";
-    std::cout << "Messages per second: " << messages_per_second << std::endl;
+    // End-to-end throughput, from the first call until the last record is written.
+    // Block keeps every record, so the rate is the one the backend sustains.
+    {
+        LoggerConfig config;
+        config.overflow_policy = OverflowPolicy::Block;
+        Logger::set_config(config);
+
+        const int record_num = 1000000;
+
+        printf("\nThroughput, %d records\n", record_num);
+        printf("%-10s %7s %10s %10s %12s %10s %10s %6s\n", "output", "threads", "enqueue s",
+               "total s", "records/s", "written", "dropped", "lost");
+
+        for (const int thread_num : {1, max_threads}) {
+            throughput("/dev/null", std::make_shared<FileSink>(null_file), thread_num, record_num);
+
+            auto file_sink = std::make_shared<FileSink>(log_path);
+            if (!file_sink->is_open()) {
+                printf("Can not open %s\n", log_path);
+                return 1;
+            }
+            throughput("file", file_sink, thread_num, record_num);
+        }
+    }
 
+    // The backend keeps writing to /dev/null until the exit, so it is not closed here
     return 0;
 }
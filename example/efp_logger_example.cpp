@@ -8,32 +8,81 @@ int main() {
     // Optional log level setting. Default is LogLevel::Info
     Logger::set_log_level(LogLevel::Trace);
 
+    // Optional queue configuration. Should be set before logging
+    // LoggerConfig config;
+    // config.queue_capacity = 1 << 16;
+    // config.overflow_policy = OverflowPolicy::Block;
+    // config.poll_period = std::chrono::milliseconds(10);
+    // config.backend_cpu = 3;
+    // config.backend_threads = 2;
+    // config.stats_period = std::chrono::seconds(10);
+    // config.flight_recorder_level = LogLevel::Info;
+    // config.lock_queue_memory = true;
+    // config.log_thread = true;
+    // config.flush_level = LogLevel::Fatal;
+    // Logger::set_config(config);
+    // Or make the logger and the queue of this thread up front
+    // Logger::init(config);
+
     // Optional log output setting. // default is stdout
     // Logger::set_output("./efp_logger_test.log");
     // Logger::set_output(stdout);
 
-    printf("sizeof PlainMessage %lu bytes\n", sizeof(detail::PlainMessage));
-    printf("sizeof FormatedMessage %lu bytes\n", sizeof(detail::FormatedMessage));
-    printf("The size of LogData: %lu bytes\n", sizeof(detail::LogData));
-    printf("sizeof std::string %lu bytes\n", sizeof(std::string));
+    // Optional. Writes the records still queued on a crash, then lets the signal end the process
+    // Logger::install_crash_handler();
+
+    // Shown after the level with LoggerConfig::log_thread
+    Logger::set_thread_name("main");
 
     int x = 42;
 
+    // Each record takes a header plus tightly packed arguments in the per-thread queue
+    printf("sizeof RecordHeader %lu bytes\n", sizeof(detail::RecordHeader));
+    printf("Record with an int: %lu bytes\n", detail::record_size(&detail::ArgSignature<int>::call_site, x));
+    printf("Record with a 1000 char std::string: %lu bytes\n",
+           detail::record_size(&detail::ArgSignature<std::string>::call_site, std::string(1000, 'a')));
+    printf("Queue capacity: %d bytes\n", EFP_LOG_BUFFER_SIZE);
+
     // Use the logging functions
     trace("This is a trace message with no formating");
-    debug("This is a debug message with a pointer: {:p}", (void*)&x);
+    // Object pointers are logged as void*
+    debug("This is a debug message with a pointer: {}", &x);
     info("This is a info message with a float: {}", 3.14f);
     warn("This is a warn message with a int: {}", 42);
     error("This is a error message with a string literal: {}", "error");
-    // ! Sending std::string to the buffer is O(n) and may increase risk of buffer overflow
-    // ! Every 20 ~ 30 char will take one buffer space.
+    // std::string, string views and char arrays are copied into the record once, with their length
     fatal("This is a fatal message with a std::string: {}", std::string("fatal error"));
 
+    // Call-site macros push a single static descriptor and are removed below EFP_LOG_ACTIVE_LEVEL
+    EFP_LOG_INFO("This is a info message from a call-site macro: {}", x);
+
+    // Rate limited call sites log the 1st, 11th, 21st... occurrence and sum up the others
+    for (int i = 0; i < 100; ++i) {
+        EFP_LOG_EVERY_N(LogLevel::Info, 10, "This is a rate limited info message: {}", i);
+    }
+
+    // Named fields follow the positional arguments, and become JSON members with OutputFormat::Json
+    info("This is a info message with fields: {}", x, kv("id", 42), kv("px", 101.25));
+
+    // Named loggers have their own queues, level and sinks
+    auto diagnostics = Logger::create("diagnostics");
+    diagnostics->set_log_level(LogLevel::Warn);
+    diagnostics->warn("This is a warn message from the {} logger", diagnostics->name());
+    EFP_LOGGER_ERROR(diagnostics, "This is a error message from a call-site macro: {}", x);
+
+    // Counters of the default logger, with the queue of each thread which has logged
+    const LoggerStats stats = Logger::stats();
+    info("This is a info message with the stats: {} queues, {} dropped warnings",
+         stats.queues.size(), stats.dropped[static_cast<size_t>(LogLevel::Warn)]);
+
     // const auto lorem_ipsum = std::string("Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.");
     // info("This is a info message with a long string: {}", lorem_ipsum);
     // const auto a_1000 = std::string(1000, 'a');
     // info("This is a info message with a 1000 char string: {}", a_1000);
     // info("Does it support Korean? {}", "한글도 되나요?");
 
+    // Waits until everything logged so far is written, for at most a second
+    Logger::flush();
+
     return 0;
 }
\ No newline at end of file
@@ -1,23 +1,84 @@
 #ifndef EFP_RT_LOG_HPP_
 #define EFP_RT_LOG_HPP_
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cerrno>
+#include <condition_variable>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
 #include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <link.h>
+#endif
 
 #include "efp.hpp"
 
-#include "fmt/args.h"
 #include "fmt/chrono.h"
 #include "fmt/color.h"
 #include "fmt/core.h"
 
 #define EFP_LOG_TIME_STAMP true
-#define EFP_LOG_BUFFER_SIZE 256
-// todo Maybe compile time log-level
-// todo Processing period configuration
+
+#define EFP_LOG_LEVEL_TRACE 0
+#define EFP_LOG_LEVEL_DEBUG 1
+#define EFP_LOG_LEVEL_INFO 2
+#define EFP_LOG_LEVEL_WARN 3
+#define EFP_LOG_LEVEL_ERROR 4
+#define EFP_LOG_LEVEL_FATAL 5
+#define EFP_LOG_LEVEL_OFF 6
+
+// Levels below EFP_LOG_ACTIVE_LEVEL are removed at compile time.
+// With the EFP_LOG_* macros their arguments are not even evaluated.
+#ifndef EFP_LOG_ACTIVE_LEVEL
+#define EFP_LOG_ACTIVE_LEVEL EFP_LOG_LEVEL_TRACE
+#endif
+// Default capacity of each per-thread queue in bytes. See LoggerConfig.
+#define EFP_LOG_BUFFER_SIZE 8192
+#define EFP_LOG_CACHE_LINE 64
+// The backend writes formatted records when the batch exceeds this size, or at the end of a drain
+#define EFP_LOG_OUTPUT_BUFFER_SIZE (1 << 18)
+
+// Read the x86 time stamp counter at enqueue instead of std::chrono::steady_clock.
+// Requires an invariant TSC synchronized across cores.
+#ifndef EFP_LOG_USE_TSC
+#define EFP_LOG_USE_TSC false
+#endif
+
+#if EFP_LOG_USE_TSC == true
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
 
 namespace efp {
     enum class LogLevel : char {
@@ -30,6 +91,161 @@ namespace efp {
         Off,
     };
 
+    static_assert(static_cast<int>(LogLevel::Off) == EFP_LOG_LEVEL_OFF,
+                  "EFP_LOG_LEVEL_* must follow LogLevel");
+
+    constexpr LogLevel active_log_level = static_cast<LogLevel>(EFP_LOG_ACTIVE_LEVEL);
+
+    // What a producer does when its queue has no room for a record
+    enum class OverflowPolicy : char {
+        // Drop the record and count it
+        DropNewest,
+        // Spin a bounded number of times, then yield until the backend makes room
+        Block,
+        // Discard the oldest records in the queue and count them
+        OverwriteOldest,
+    };
+
+    struct LoggerConfig {
+        // Capacity of each per-thread queue in bytes. Rounded up to a power of two.
+        size_t queue_capacity = EFP_LOG_BUFFER_SIZE;
+        // Queue memory is prefaulted when the queue is made. This also locks it in RAM, which
+        // may need a higher RLIMIT_MEMLOCK. POSIX only.
+        bool lock_queue_memory = false;
+        // Backs each queue with huge pages, rounding its memory up to the huge page size.
+        // Falls back to transparent huge pages, then to normal pages. Linux only.
+        bool huge_page_queues = false;
+        OverflowPolicy overflow_policy = OverflowPolicy::DropNewest;
+        // Spins before yielding with OverflowPolicy::Block
+        size_t block_spin_num = 1024;
+        // The backend logs the stats of the logger at this period. 0 disables the report.
+        std::chrono::seconds stats_period{0};
+        // The backend logs the records suppressed by each rate limited call site at this period
+        std::chrono::seconds suppressed_period{1};
+        // Prints the thread of each record after the level, by the name set with
+        // Logger::set_thread_name() or by its number
+        bool log_thread = false;
+        // A record at this level or above makes the logging thread wait until it is written,
+        // for at most flush_timeout. Off disables it.
+        LogLevel flush_level = LogLevel::Off;
+        std::chrono::milliseconds flush_timeout{100};
+        // Records below this level go unformatted into a per-thread ring instead, which is
+        // printed when a record at flight_recorder_trigger or above is logged, or on
+        // dump_flight_recorder(). They pass the log level. Trace disables the flight recorder.
+        LogLevel flight_recorder_level = LogLevel::Trace;
+        LogLevel flight_recorder_trigger = LogLevel::Error;
+        // Capacity of each per-thread ring in bytes, holding the last records. Rounded up to a
+        // power of two.
+        size_t flight_recorder_capacity = 1 << 16;
+
+        // The backend settings below take effect on the next backend cycle. The backend
+        // threads serve every logger, so they are read from the config of the default logger.
+
+        // Longest sleep of the backend between drains
+        std::chrono::microseconds poll_period = std::chrono::milliseconds(1);
+        // A producer wakes the backend early once its queue is filled to this percentage,
+        // or when a record does not fit. 0 leaves the backend to the poll period.
+        unsigned wakeup_fill_percent = 50;
+        // Drain continuously without sleeping, for hosts with a core to spare
+        bool busy_spin = false;
+        // Pins the backend threads to consecutive CPUs from this one if not negative. Linux only.
+        int backend_cpu = -1;
+        // Runs the backend threads with SCHED_FIFO at this priority if positive. POSIX only.
+        int backend_priority = 0;
+        // Backend threads draining the loggers. The pool only grows.
+        unsigned backend_threads = 1;
+        // Threads formatting the records of each backend thread, including itself. Above 1,
+        // the records of a turn are split across them and written in order. Only grows.
+        unsigned format_threads = 1;
+    };
+
+    constexpr size_t log_level_num = static_cast<size_t>(LogLevel::Off);
+
+    // Counters of the queue of one producer thread
+    struct QueueStats {
+        std::thread::id thread_id;
+        size_t capacity;
+        // Highest fill in bytes, sampled by the backend at each snapshot
+        size_t high_water;
+        // Per level
+        uint64_t enqueued[log_level_num];
+        // Records which did not fit, per level
+        uint64_t dropped[log_level_num];
+        // Records discarded by OverflowPolicy::OverwriteOldest, of unknown level
+        uint64_t overwritten;
+    };
+
+    // Totals since the logger was made
+    struct LoggerStats {
+        // Including the queues of exited threads
+        uint64_t enqueued[log_level_num];
+        uint64_t dropped[log_level_num];
+        uint64_t overwritten;
+        // Queues of the threads which have logged and not been reclaimed yet
+        std::vector<QueueStats> queues;
+        // Records drained per backend snapshot
+        uint64_t batch_num;
+        uint64_t batch_record_num;
+        uint64_t max_batch_size;
+        // From enqueue until the backend flushed the batch holding the record
+        uint64_t written;
+        uint64_t latency_sum_ns;
+        uint64_t max_latency_ns;
+        // Backend time spent formatting records and in Sink::write
+        uint64_t format_ns;
+        uint64_t write_ns;
+    };
+
+    enum class OutputFormat : char {
+        Text,
+        // Encoded records, turned into text by efp_logger_decode
+        Binary,
+        // One JSON object per line, with the message and the kv() fields
+        Json,
+    };
+
+    // Sub-second digits of the time stamp printed on each record
+    enum class TimePrecision : char {
+        Sec,
+        Milli,
+        Micro,
+        Nano,
+    };
+
+    // Named field of a record, made by kv(). Only lives for the logging call.
+    template <typename T>
+    struct KeyValue {
+        const char* key;
+        const T& value;
+    };
+
+    // The key is stored by address, so it has to outlive the record as string literals do
+    template <typename T>
+    inline KeyValue<T> kv(const char* key, const T& value) {
+        return KeyValue<T>{key, value};
+    }
+
+    // Copies an argument of a user type into the record, so that its fmt::formatter runs on
+    // the backend instead of the logging thread. Trivially copyable types are copied by bytes.
+    // Specialize it for other types: size() and encode() run on the logging thread and write
+    // the bytes, decode() runs on the backend and returns a value with a fmt::formatter.
+    template <typename T>
+    struct LogCodec {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "specialize efp::LogCodec to log a type which is not trivially copyable");
+
+        static inline size_t size(const T&) { return sizeof(T); }
+
+        static inline void encode(char* dst, const T& value) { std::memcpy(dst, &value, sizeof(T)); }
+
+        // The source is not aligned
+        static inline T decode(const char* src, size_t) {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+            std::memcpy(&storage, src, sizeof(T));
+            return *reinterpret_cast<const T*>(&storage);
+        }
+    };
+
     namespace detail {
         inline const char* log_level_cstr(LogLevel log_level) {
             switch (log_level) {
@@ -75,438 +291,5282 @@ namespace efp {
             }
         }
 
-        struct PlainMessage {
-            const char* str;
-            LogLevel level;
-        };
+        // Level prefixes and ANSI escapes rendered once
+        struct OutputStyle {
+            OutputStyle() {
+                for (int i = 0; i <= static_cast<int>(LogLevel::Off); ++i) {
+                    const LogLevel level = static_cast<LogLevel>(i);
+                    plain_level[i] = fmt::format("{} ", log_level_cstr(level));
+                    colored_level[i] = fmt::format(log_level_print_style(level), "{} ",
+                                                   log_level_cstr(level));
 
-        struct FormatedMessage {
-            const char* fmt_str;
-            uint8_t arg_num;
-            LogLevel level;
-        };
+                    // The level names are padded for the text layout
+                    std::string name = log_level_cstr(level);
+                    name.erase(name.find_last_not_of(' ') + 1);
+                    json_level[i] = fmt::format("\"level\":\"{}\",", name);
+                }
+
+                // fmt emits the style escape, the text and the reset escape
+                const std::string styled = fmt::format(fg(fmt::color::gray), "{}", "");
+                time_begin = styled.substr(0, styled.size() - std::strlen(reset));
+            }
 
-        constexpr uint8_t stl_string_data_capacity = sizeof(FormatedMessage);
-        constexpr uint8_t stl_string_head_capacity = stl_string_data_capacity - sizeof(size_t);
+            static constexpr const char* reset = "\x1b[0m";
 
-        // Data structure for std::string preventing each char takes size of full Enum;
-        struct StlStringHead {
-            size_t length;
-            char chars[stl_string_head_capacity];
+            std::string plain_level[static_cast<int>(LogLevel::Off) + 1];
+            std::string colored_level[static_cast<int>(LogLevel::Off) + 1];
+            std::string json_level[static_cast<int>(LogLevel::Off) + 1];
+            std::string time_begin;
         };
 
-        // Data structure for std::string preventing each char takes size of full Enum;
-        // Some of the char may not be valid depending on the length specified by head
-        struct StlStringData {
-            char chars[stl_string_data_capacity];
-        };
+        constexpr const char* OutputStyle::reset;
+
+        inline void append(fmt::memory_buffer& buffer, fmt::string_view str) {
+            buffer.append(str.data(), str.data() + str.size());
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        // Async-signal-safe
+        inline void write_fd(int fd, const char* data, size_t size) {
+            while (size > 0) {
+                const ssize_t written = ::write(fd, data, size);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return;
+                }
+                data += written;
+                size -= static_cast<size_t>(written);
+            }
+        }
+#endif
+
+        // -1 where there is none
+        inline int file_descriptor(std::FILE* file) {
+#if defined(__unix__) || defined(__APPLE__)
+            return file ? fileno(file) : -1;
+#else
+            (void)file;
+            return -1;
+#endif
+        }
 
-        using LogData =
-            Enum<PlainMessage, FormatedMessage, int, short, long, long long,
-                 unsigned int, unsigned short, unsigned long, unsigned long long, char,
-                 signed char, unsigned char, bool, float, double, long double,
-                 const char*, void*, StlStringHead, StlStringData>;
+        // Writes with a single write call where possible
+        inline void write_file(std::FILE* file, const char* data, size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+            // Anything buffered by stdio goes first
+            std::fflush(file);
+            write_fd(fileno(file), data, size);
+#else
+            std::fwrite(data, 1, size, file);
+            std::fflush(file);
+#endif
+        }
+
+        // Returns false if the platform or the permissions do not allow it
+        inline bool pin_current_thread(int cpu) {
+#if defined(__linux__)
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(cpu, &cpu_set);
+            return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set) == 0;
+#else
+            (void)cpu;
+            return false;
+#endif
+        }
+
+        // SCHED_FIFO for a positive priority, SCHED_OTHER otherwise
+        inline bool set_current_thread_priority(int priority) {
+#if defined(__unix__) || defined(__APPLE__)
+            sched_param param{};
+            param.sched_priority = priority > 0 ? priority : 0;
+            return pthread_setschedparam(pthread_self(), priority > 0 ? SCHED_FIFO : SCHED_OTHER,
+                                         &param) == 0;
+#else
+            (void)priority;
+            return false;
+#endif
+        }
+
+        // Cheap monotonic tick read on the producer side
+        inline uint64_t now_ticks() {
+#if EFP_LOG_USE_TSC == true
+            return __rdtsc();
+#else
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                .count();
+#endif
+        }
+
+        inline int64_t wall_now_ns() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                .count();
+        }
 
-        class Spinlock {
+        // Converts producer ticks to wall clock nanoseconds on the backend.
+        // The base is refreshed on every calibration so wall clock adjustments are followed.
+        class TickCalibrator {
         public:
-            inline void lock() {
-                while (flag_.test_and_set(std::memory_order_acquire)) {
+            TickCalibrator()
+                : _first_ticks(now_ticks()),
+                  _first_steady_ns(steady_now_ns()),
+                  _ns_per_tick(1.0) {
+#if EFP_LOG_USE_TSC == true
+                // Initial rate estimate over a short busy wait, refined by later calibrations
+                while (steady_now_ns() - _first_steady_ns < 10000000) {
+                }
+#endif
+                calibrate();
+            }
+
+            inline void calibrate() {
+                _base_ticks = now_ticks();
+                _base_wall_ns = wall_now_ns();
+#if EFP_LOG_USE_TSC == true
+                const uint64_t elapsed_ticks = _base_ticks - _first_ticks;
+                if (elapsed_ticks > 0) {
+                    _ns_per_tick = static_cast<double>(steady_now_ns() - _first_steady_ns) /
+                                   static_cast<double>(elapsed_ticks);
                 }
+#endif
             }
 
-            inline void unlock() { flag_.clear(std::memory_order_release); }
+            inline int64_t to_wall_ns(uint64_t ticks) const {
+                const int64_t delta_ticks = static_cast<int64_t>(ticks - _base_ticks);
+                return _base_wall_ns + static_cast<int64_t>(delta_ticks * _ns_per_tick);
+            }
 
         private:
-            std::atomic_flag flag_ = ATOMIC_FLAG_INIT;
+            static inline int64_t steady_now_ns() {
+                return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now().time_since_epoch())
+                    .count();
+            }
+
+            uint64_t _first_ticks;
+            int64_t _first_steady_ns;
+            double _ns_per_tick;
+            uint64_t _base_ticks;
+            int64_t _base_wall_ns;
         };
 
-        class LogBuffer {
+        // Renders "%Y-%m-%d %H:%M:%S" only when the second changes
+        class TimeStampCache {
         public:
-            explicit LogBuffer()
-                : _read_buffer(new Vcq<detail::LogData, EFP_LOG_BUFFER_SIZE>{}),
-                  _write_buffer(new Vcq<detail::LogData, EFP_LOG_BUFFER_SIZE>{}) {}
+            TimeStampCache() : _sec(0), _size(0), _precision(TimePrecision::Sec) {}
 
-            ~LogBuffer() {
-                delete _read_buffer;
-                delete _write_buffer;
-            }
+            inline void set_precision(TimePrecision precision) { _precision = precision; }
 
-            LogBuffer(const LogBuffer& other) = delete;
-            LogBuffer& operator=(const LogBuffer& other) = delete;
+            inline TimePrecision get_precision() const { return _precision; }
 
-            LogBuffer(LogBuffer&& other) noexcept = delete;
-            LogBuffer& operator=(LogBuffer&& other) noexcept = delete;
+            fmt::string_view render(int64_t wall_ns) {
+                const int64_t ns_in_sec = 1000000000;
+                int64_t sec = wall_ns / ns_in_sec;
+                int64_t sub_ns = wall_ns % ns_in_sec;
+                if (sub_ns < 0) {
+                    sec -= 1;
+                    sub_ns += ns_in_sec;
+                }
 
-            template <typename A>
-            inline Unit enqueue_arg(A a) {
-                _write_buffer->push_back(detail::LogData{efp::forward<A>(a)});
-                return unit;
+                if (sec != _sec || _size == 0) {
+                    const std::chrono::time_point<std::chrono::system_clock, std::chrono::seconds>
+                        time_point{std::chrono::seconds{sec}};
+                    const auto result = fmt::format_to_n(_buffer, sizeof(_buffer),
+                                                         "{:%Y-%m-%d %H:%M:%S}", time_point);
+                    _sec = sec;
+                    _prefix_size = result.size < sizeof(_buffer) ? result.size : sizeof(_buffer);
+                }
+
+                _size = _prefix_size;
+                switch (_precision) {
+                case TimePrecision::Milli:
+                    append_fraction(sub_ns / 1000000, 3);
+                    break;
+                case TimePrecision::Micro:
+                    append_fraction(sub_ns / 1000, 6);
+                    break;
+                case TimePrecision::Nano:
+                    append_fraction(sub_ns, 9);
+                    break;
+                default:
+                    break;
+                }
+
+                return fmt::string_view{_buffer, _size};
             }
 
-            // todo Need pointer casting specialization
-            inline Unit enqueue_arg(const std::string& a) {
-                const auto str_length = a.length();
+        private:
+            inline void append_fraction(int64_t fraction, size_t digits) {
+                if (_size + 1 + digits > sizeof(_buffer)) {
+                    return;
+                }
+                _buffer[_size] = '.';
+                for (size_t i = digits; i > 0; --i) {
+                    _buffer[_size + i] = static_cast<char>('0' + fraction % 10);
+                    fraction /= 10;
+                }
+                _size += 1 + digits;
+            }
 
-                StlStringHead head{};
-                const auto chars_in_head = str_length < stl_string_head_capacity
-                                               ? str_length
-                                               : stl_string_head_capacity;
+            int64_t _sec;
+            size_t _prefix_size;
+            size_t _size;
+            TimePrecision _precision;
+            char _buffer[48];
+        };
 
-                _memcpy(head.chars, a.data(), chars_in_head);
+        enum class ArgType : uint8_t {
+            Int,
+            Short,
+            Long,
+            LongLong,
+            UInt,
+            UShort,
+            ULong,
+            ULongLong,
+            Char,
+            SChar,
+            UChar,
+            Bool,
+            Float,
+            Double,
+            LongDouble,
+            CStr,
+            Pointer,
+            // std::string, string views and char arrays, copied as uint32_t length and chars
+            StlString,
+            // Other types, through efp::LogCodec. Copied as the CustomArgCodec pointer,
+            // uint32_t size and the encoded bytes.
+            Custom,
+        };
 
-                head.length = str_length;
+        // Other object pointers are logged as void*
+        template <typename A>
+        struct ArgTypeOf {
+            static_assert(!std::is_array<A>::value, "only char arrays can be logged as arrays");
 
-                _write_buffer->push_back(head);
+            static constexpr ArgType value =
+                std::is_pointer<A>::value &&
+                        !std::is_function<typename std::remove_pointer<A>::type>::value
+                    ? ArgType::Pointer
+                    : ArgType::Custom;
+        };
 
-                if (str_length > stl_string_head_capacity) {
-                    int remaining_length = str_length - chars_in_head;
-                    size_t offset = chars_in_head;
+#define EFP_LOG_ARG_TYPE_OF_(type, arg_type) \
+    template <>                              \
+    struct ArgTypeOf<type> {                 \
+        static constexpr ArgType value = arg_type; \
+    };
 
-                    while (remaining_length > 0) {
-                        StlStringData data{};
-                        size_t length_to_push = remaining_length < stl_string_data_capacity
-                                                    ? remaining_length
-                                                    : stl_string_data_capacity;
+        EFP_LOG_ARG_TYPE_OF_(int, ArgType::Int)
+        EFP_LOG_ARG_TYPE_OF_(short, ArgType::Short)
+        EFP_LOG_ARG_TYPE_OF_(long, ArgType::Long)
+        EFP_LOG_ARG_TYPE_OF_(long long, ArgType::LongLong)
+        EFP_LOG_ARG_TYPE_OF_(unsigned int, ArgType::UInt)
+        EFP_LOG_ARG_TYPE_OF_(unsigned short, ArgType::UShort)
+        EFP_LOG_ARG_TYPE_OF_(unsigned long, ArgType::ULong)
+        EFP_LOG_ARG_TYPE_OF_(unsigned long long, ArgType::ULongLong)
+        EFP_LOG_ARG_TYPE_OF_(char, ArgType::Char)
+        EFP_LOG_ARG_TYPE_OF_(signed char, ArgType::SChar)
+        EFP_LOG_ARG_TYPE_OF_(unsigned char, ArgType::UChar)
+        EFP_LOG_ARG_TYPE_OF_(bool, ArgType::Bool)
+        EFP_LOG_ARG_TYPE_OF_(float, ArgType::Float)
+        EFP_LOG_ARG_TYPE_OF_(double, ArgType::Double)
+        EFP_LOG_ARG_TYPE_OF_(long double, ArgType::LongDouble)
+        EFP_LOG_ARG_TYPE_OF_(const char*, ArgType::CStr)
+        EFP_LOG_ARG_TYPE_OF_(char*, ArgType::CStr)
+        EFP_LOG_ARG_TYPE_OF_(void*, ArgType::Pointer)
+        EFP_LOG_ARG_TYPE_OF_(std::string, ArgType::StlString)
+        EFP_LOG_ARG_TYPE_OF_(fmt::string_view, ArgType::StlString)
+#if __cplusplus >= 201703L
+        EFP_LOG_ARG_TYPE_OF_(std::string_view, ArgType::StlString)
+#endif
 
-                        _memcpy(data.chars, a.data() + offset, length_to_push);
+#undef EFP_LOG_ARG_TYPE_OF_
 
-                        _write_buffer->push_back(data);
+        // A char array may be a stack buffer, so it is copied rather than passed as a pointer
+        template <size_t N>
+        struct ArgTypeOf<char[N]> {
+            static constexpr ArgType value = ArgType::StlString;
+        };
 
-                        offset += length_to_push;
-                        remaining_length -= length_to_push;
-                    }
-                }
+        // Arrays are kept, as they are not the same argument as a pointer
+        template <typename A>
+        using ArgKey = typename std::remove_cv<typename std::remove_reference<A>::type>::type;
 
-                return unit;
-            }
+        // A kv() field is the type of its value with this flag, encoded as the key pointer
+        // followed by the value
+        constexpr uint8_t arg_field_flag = 0x80;
 
-            template <typename... Args>
-            inline void enqueue(LogLevel level, const char* fmt_str,
-                                const Args&... args) {
-                if (sizeof...(args) == 0) {
-                    _spinlock.lock();
-                    _write_buffer->push_back(detail::PlainMessage{
-                        fmt_str,
-                        level,
-                    });
-                    _spinlock.unlock();
-                } else {
-                    _spinlock.lock();
-                    _write_buffer->push_back(detail::FormatedMessage{
-                        fmt_str,
-                        sizeof...(args),
-                        level,
-                    });
+        constexpr bool is_field(ArgType arg_type) {
+            return (static_cast<uint8_t>(arg_type) & arg_field_flag) != 0;
+        }
 
-                    execute_pack(enqueue_arg(args)...);
-                    _spinlock.unlock();
-                }
-            }
-
-            inline void swap_buffer() {
-                _spinlock.lock();
-                efp::swap(_write_buffer, _read_buffer);
-                _spinlock.unlock();
-            }
-
-            void collect_dyn_args(size_t arg_num) {
-                const auto collect_arg = [&](size_t) {
-                    _read_buffer->pop_front().match(
-                        [&](int arg) { _dyn_args.push_back(arg); },
-                        [&](short arg) { _dyn_args.push_back(arg); },
-                        [&](long arg) { _dyn_args.push_back(arg); },
-                        [&](long long arg) { _dyn_args.push_back(arg); },
-                        [&](unsigned int arg) { _dyn_args.push_back(arg); },
-                        [&](unsigned short arg) { _dyn_args.push_back(arg); },
-                        [&](unsigned long arg) { _dyn_args.push_back(arg); },
-                        [&](unsigned long long arg) { _dyn_args.push_back(arg); },
-                        [&](char arg) { _dyn_args.push_back(arg); },
-                        [&](signed char arg) { _dyn_args.push_back(arg); },
-                        [&](unsigned char arg) { _dyn_args.push_back(arg); },
-                        [&](bool arg) { _dyn_args.push_back(arg); },
-                        [&](float arg) { _dyn_args.push_back(arg); },
-                        [&](double arg) { _dyn_args.push_back(arg); },
-                        [&](long double arg) { _dyn_args.push_back(arg); },
-                        [&](const char* arg) { _dyn_args.push_back(arg); },
-                        [&](void* arg) { _dyn_args.push_back(arg); },
-                        [&](const StlStringHead& arg) {
-                            std::string str;
-                            str.append(arg.chars, arg.length < stl_string_head_capacity
-                                                      ? arg.length
-                                                      : stl_string_head_capacity);
-
-                            // Extracting the remaining parts of the string if necessary
-                            size_t remaining_length = arg.length - stl_string_head_capacity;
-                            while (remaining_length > 0) {
-                                _read_buffer->pop_front().match(
-                                    [&](const StlStringData& d) {
-                                        const uint8_t append_length =
-                                            remaining_length < stl_string_data_capacity
-                                                ? remaining_length
-                                                : stl_string_data_capacity;
-                                        str.append(d.chars, append_length);
-                                        remaining_length -= append_length;
-                                    },
-                                    []() { fmt::println("String reconstruction error"); });
-                            }
+        constexpr ArgType field_value_type(ArgType arg_type) {
+            return static_cast<ArgType>(static_cast<uint8_t>(arg_type) & ~arg_field_flag);
+        }
 
-                            _dyn_args.push_back(str);
-                        },
-                        [&]() {
-                            fmt::println(
-                                "Potential error. this messege should not be displayed");
-                        });
-                };
+        template <typename T>
+        struct ArgTypeOf<KeyValue<T>> {
+            static constexpr ArgType value =
+                static_cast<ArgType>(static_cast<uint8_t>(ArgTypeOf<ArgKey<T>>::value) | arg_field_flag);
+        };
 
-                for_index(collect_arg, arg_num);
-            }
-            void clear_dyn_args() { _dyn_args.clear(); }
+        // Static per call-site descriptor registered by the EFP_LOG_* macros
+        struct CallSite {
+            const char* fmt_str;
+            LogLevel level;
+            const char* file;
+            int line;
+            uint8_t arg_num;
+            const ArgType* arg_types;
+        };
 
-            void dequeue() {
-                _read_buffer->pop_front().match(
-                    [&](const PlainMessage& str) {
-                        if (_output_file == stdout) {
-                            fmt::print(_output_file, log_level_print_style(str.level), "{} ",
-                                       log_level_cstr(str.level));
-                        } else {
-                            fmt::print(_output_file, "{} ", log_level_cstr(str.level));
-                        }
-                        fmt::print(_output_file, "{}", str.str);
-                        fmt::print(_output_file, "\n");
-                    },
-                    [&](const FormatedMessage& fstr) {
-                        collect_dyn_args(fstr.arg_num);
-                        if (_output_file == stdout) {
-                            fmt::print(_output_file, log_level_print_style(fstr.level), "{} ",
-                                       log_level_cstr(fstr.level));
-                        } else {
-                            fmt::print(_output_file, "{} ", log_level_cstr(fstr.level));
-                        }
-                        fmt::vprint(_output_file, fstr.fmt_str, _dyn_args);
-                        fmt::print(_output_file, "\n");
+        // Per call-site state of the rate limited macros. The check takes a few relaxed atomic
+        // operations and comes before any argument is encoded.
+        class RateLimiter {
+        public:
+            // Logs the first first_n occurrences, then every every_n-th one if every_n is not 0.
+            // With a positive interval, logs at most one occurrence per interval instead.
+            template <typename Rep, typename Period>
+            RateLimiter(const CallSite* site, uint64_t first_n, uint64_t every_n,
+                        std::chrono::duration<Rep, Period> interval)
+                : _site(site),
+                  _first_n(first_n),
+                  _every_n(every_n),
+                  _interval_ns(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count()),
+                  _count(0),
+                  _next_ns(0),
+                  _suppressed(0),
+                  _registered(false) {}
 
-                        clear_dyn_args();
-                    },
-                    []() {
-                        fmt::println("invalid log data. first data has to be format string");
-                    });
+            inline const CallSite* site() const { return _site; }
+
+            // Whether this occurrence is logged. Counts it as suppressed otherwise.
+            inline bool allow() {
+                bool allowed;
+                if (_interval_ns > 0) {
+                    const int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                               std::chrono::steady_clock::now().time_since_epoch())
+                                               .count();
+                    int64_t next_ns = _next_ns.load(std::memory_order_relaxed);
+                    allowed = now_ns >= next_ns &&
+                              _next_ns.compare_exchange_strong(next_ns, now_ns + _interval_ns,
+                                                               std::memory_order_relaxed);
+                } else {
+                    const uint64_t count = _count.fetch_add(1, std::memory_order_relaxed);
+                    allowed = count < _first_n ||
+                              (_every_n != 0 && (count - _first_n) % _every_n == 0);
+                }
+
+                if (!allowed) {
+                    _suppressed.fetch_add(1, std::memory_order_relaxed);
+                }
+                return allowed;
             }
 
-            void dequeue_with_time(
-                const std::chrono::time_point<std::chrono::system_clock,
-                                              std::chrono::seconds>& time_point) {
-                _read_buffer->pop_front().match(
-                    [&](const PlainMessage& msg) {
-                        if (_output_file == stdout) {
-                            fmt::print(_output_file, fg(fmt::color::gray),
-                                       "{:%Y-%m-%d %H:%M:%S} ", time_point);
-                            fmt::print(_output_file, log_level_print_style(msg.level), "{} ",
-                                       log_level_cstr(msg.level));
-                        } else {
-                            fmt::print(_output_file, "{:%Y-%m-%d %H:%M:%S} ", time_point);
-                            fmt::print(_output_file, "{} ", log_level_cstr(msg.level));
-                        }
-                        fmt::print(_output_file, "{}", msg.str);
-                        fmt::print(_output_file, "\n");
-                    },
-                    [&](const FormatedMessage& msg) {
-                        collect_dyn_args(msg.arg_num);
-
-                        if (_output_file == stdout) {
-                            fmt::print(_output_file, fg(fmt::color::gray),
-                                       "{:%Y-%m-%d %H:%M:%S} ", time_point);
-                            fmt::print(_output_file, log_level_print_style(msg.level), "{} ",
-                                       log_level_cstr(msg.level));
-                        } else {
-                            fmt::print(_output_file, "{:%Y-%m-%d %H:%M:%S} ", time_point);
-                            fmt::print(_output_file, "{} ", log_level_cstr(msg.level));
-                        }
-                        fmt::vprint(_output_file, msg.fmt_str, _dyn_args);
-                        fmt::print(_output_file, "\n");
+            // True once, for the caller to register the site for the suppressed summary
+            inline bool claim_registration() {
+                return !_registered.load(std::memory_order_relaxed) &&
+                       !_registered.exchange(true, std::memory_order_relaxed);
+            }
 
-                        clear_dyn_args();
-                    },
-                    []() {
-                        fmt::println("invalid log data. first data has to be format string");
-                    });
+            inline uint64_t take_suppressed() {
+                return _suppressed.exchange(0, std::memory_order_relaxed);
             }
 
-            inline bool empty() { return _read_buffer->empty(); }
+        private:
+            const CallSite* const _site;
+            const uint64_t _first_n;
+            const uint64_t _every_n;
+            const int64_t _interval_ns;
+            std::atomic<uint64_t> _count;
+            std::atomic<int64_t> _next_ns;
+            std::atomic<uint64_t> _suppressed;
+            std::atomic<bool> _registered;
+        };
 
-            inline void set_output_file(FILE* output_file) { _output_file = output_file; }
+        // Argument type list of a call
+        template <typename... Args>
+        struct ArgSignature {
+            static constexpr uint8_t arg_num = sizeof...(Args);
+            // One trailing element keeps the array non-empty
+            static constexpr ArgType types[sizeof...(Args) + 1] = {
+                ArgTypeOf<ArgKey<Args>>::value...,
+                ArgType::Int,
+            };
 
-            inline void set_log_level(LogLevel log_level) { _log_level = log_level; }
+            // Descriptor of the free function calls, whose format string is given at runtime
+            static const CallSite call_site;
+        };
 
-            inline LogLevel get_log_level() { return _log_level; }
+        template <typename... Args>
+        constexpr ArgType ArgSignature<Args...>::types[sizeof...(Args) + 1];
 
-        private:
-            Spinlock _spinlock;
-            Vcq<LogData, EFP_LOG_BUFFER_SIZE>* _write_buffer;
-            Vcq<LogData, EFP_LOG_BUFFER_SIZE>* _read_buffer;
-            fmt::dynamic_format_arg_store<fmt::format_context> _dyn_args;
-            LogLevel _log_level = LogLevel::Info;
-            std::FILE* _output_file = stdout;
+        template <typename... Args>
+        const CallSite ArgSignature<Args...>::call_site{
+            nullptr,
+            LogLevel::Off,
+            nullptr,
+            0,
+            sizeof...(Args),
+            ArgSignature<Args...>::types,
         };
 
-    } // namespace detail
+        // Only used in unevaluated context
+        template <typename... Args>
+        ArgSignature<Args...> arg_signature(const char* fmt_str, const Args&... args);
 
-    // The main logger class
+        // Every record in a LogQueue starts with a header. If the call site has no format string,
+        // the format string pointer follows. Then the arguments are tightly packed without alignment.
+        struct RecordHeader {
+            uint32_t size;
+            LogLevel level;
+            // In the padding, so it adds nothing to the record. 0 for the backend reports.
+            uint16_t thread_index;
+            uint64_t time_stamp;
+            const CallSite* site;
+        };
 
-    class Logger {
-        // friend class detail::LocalLogger;
+        constexpr size_t record_alignment = alignof(RecordHeader);
 
-    public:
-        ~Logger() {
-            _run.store(false);
+        inline fmt::string_view string_arg(const std::string& a) { return {a.data(), a.size()}; }
 
-            if (_thread.joinable())
-                _thread.join();
+        inline fmt::string_view string_arg(fmt::string_view a) { return a; }
 
-#if EFP_LOG_TIME_STAMP == true
-            process_with_time();
-            process_with_time();
-#else
-            process();
-            process();
+#if __cplusplus >= 201703L
+        inline fmt::string_view string_arg(std::string_view a) { return {a.data(), a.size()}; }
 #endif
+
+        // Up to the first NUL, as the array may hold a shorter string
+        template <size_t N>
+        inline fmt::string_view string_arg(const char (&a)[N]) {
+            const void* end = std::memchr(a, '\0', N);
+            return {a, end ? static_cast<size_t>(static_cast<const char*>(end) - a) : N};
         }
 
-        static inline Logger& instance() {
-            static Logger inst{};
-            return inst;
+        // Formats a custom argument on the backend, from its encoded bytes
+        struct CustomArgCodec {
+            void (*format)(fmt::memory_buffer& out, const char* data, size_t size,
+                           fmt::string_view spec);
+        };
+
+        // Defined after the formatting functions
+        template <typename T>
+        struct CustomArgOf;
+
+        // Encodes an argument into the record. Fixed size arguments are copied as they are.
+        template <typename A, ArgType = ArgTypeOf<ArgKey<A>>::value>
+        struct ArgCodec {
+            static inline size_t size(const A&) { return sizeof(A); }
+
+            static inline char* encode(char* dst, const A& a) {
+                std::memcpy(dst, &a, sizeof(A));
+                return dst + sizeof(A);
+            }
+        };
+
+        // Strings are copied once into the record, so the backend reads them in place
+        template <typename A>
+        struct ArgCodec<A, ArgType::StlString> {
+            static inline size_t size(const A& a) { return sizeof(uint32_t) + string_arg(a).size(); }
+
+            static inline char* encode(char* dst, const A& a) {
+                const fmt::string_view str = string_arg(a);
+                const uint32_t length = static_cast<uint32_t>(str.size());
+                std::memcpy(dst, &length, sizeof(uint32_t));
+                std::memcpy(dst + sizeof(uint32_t), str.data(), length);
+                return dst + sizeof(uint32_t) + length;
+            }
+        };
+
+        // User types are encoded by efp::LogCodec, and formatted through their descriptor
+        template <typename A>
+        struct ArgCodec<A, ArgType::Custom> {
+            static inline size_t size(const A& a) {
+                return sizeof(const CustomArgCodec*) + sizeof(uint32_t) + LogCodec<A>::size(a);
+            }
+
+            static inline char* encode(char* dst, const A& a) {
+                const CustomArgCodec* codec = &CustomArgOf<A>::codec;
+                const uint32_t size = static_cast<uint32_t>(LogCodec<A>::size(a));
+                std::memcpy(dst, &codec, sizeof(const CustomArgCodec*));
+                std::memcpy(dst + sizeof(const CustomArgCodec*), &size, sizeof(uint32_t));
+                dst += sizeof(const CustomArgCodec*) + sizeof(uint32_t);
+                LogCodec<A>::encode(dst, a);
+                return dst + size;
+            }
+        };
+
+        template <typename T, ArgType arg_type>
+        struct ArgCodec<KeyValue<T>, arg_type> {
+            static inline size_t size(const KeyValue<T>& a) {
+                return sizeof(const char*) + ArgCodec<T>::size(a.value);
+            }
+
+            static inline char* encode(char* dst, const KeyValue<T>& a) {
+                std::memcpy(dst, &a.key, sizeof(const char*));
+                return ArgCodec<T>::encode(dst + sizeof(const char*), a.value);
+            }
+        };
+
+        template <typename A>
+        inline size_t arg_size(const A& a) {
+            return ArgCodec<A>::size(a);
         }
 
-        static inline void set_log_level(LogLevel log_level) {
+        template <typename A>
+        inline char* encode_arg(char* dst, const A& a) {
+            return ArgCodec<A>::encode(dst, a);
+        }
 
-            instance()._log_buffer.set_log_level(log_level);
+        template <typename A>
+        inline A decode_arg(const char*& src) {
+            A a;
+            std::memcpy(&a, src, sizeof(A));
+            src += sizeof(A);
+            return a;
         }
 
-        static inline LogLevel get_log_level() {
-            return instance()._log_buffer.get_log_level();
+        inline fmt::string_view decode_string(const char*& src) {
+            const uint32_t length = decode_arg<uint32_t>(src);
+            const fmt::string_view str{src, length};
+            src += length;
+            return str;
         }
 
-        static void set_output(FILE* output_file) {
-            instance()._log_buffer.set_output_file(output_file);
+        struct CustomValue {
+            const CustomArgCodec* codec;
+            const char* data;
+            uint32_t size;
+        };
+
+        inline CustomValue decode_custom(const char*& src) {
+            const CustomArgCodec* codec = decode_arg<const CustomArgCodec*>(src);
+            const uint32_t size = decode_arg<uint32_t>(src);
+            const CustomValue value{codec, src, size};
+            src += size;
+            return value;
         }
 
-        static void set_output(const char* path) {
+        template <typename... Args>
+        inline size_t record_size(const CallSite* site, const Args&... args) {
+            size_t size = sizeof(RecordHeader) + (site->fmt_str == nullptr ? sizeof(const char*) : 0);
+            const int dummy[] = {0, (size += arg_size(args), 0)...};
+            (void)dummy;
+            return (size + record_alignment - 1) & ~(record_alignment - 1);
+        }
 
-            FILE* output_file = fopen(path, "a");
-            if (output_file) {
-                instance()._log_buffer.set_output_file(output_file);
-            } else {
-                printf("Can not open the ouput file");
-                abort();
+        inline size_t ceil_pow2(size_t n) {
+            size_t result = 1;
+            while (result < n) {
+                result <<= 1;
             }
+            return result;
         }
 
-        // todo set_config
+        // Wakes the backend before its poll period. Producers check the flag first, so only
+        // the one which actually wakes the backend takes the mutex and notifies.
+        class WakeupSignal {
+        public:
+            WakeupSignal() : _requested(false) {}
 
-        void process() {
+            WakeupSignal(const WakeupSignal& other) = delete;
+            WakeupSignal& operator=(const WakeupSignal& other) = delete;
 
-            _log_buffer.swap_buffer();
+            inline void notify() {
+                if (!_requested.load(std::memory_order_relaxed) &&
+                    !_requested.exchange(true, std::memory_order_acq_rel)) {
+                    // Orders the flag with a backend which is about to wait
+                    { std::lock_guard<std::mutex> lock(_mutex); }
+                    _cv.notify_one();
+                }
+            }
 
-            while (!_log_buffer.empty()) {
-                _log_buffer.dequeue();
+            // Returns after period or on notify
+            inline void wait_for(std::chrono::microseconds period) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait_for(lock, period,
+                             [this]() { return _requested.load(std::memory_order_acquire); });
+                _requested.store(false, std::memory_order_relaxed);
             }
-        }
 
-        void process_with_time() {
-            const auto now = std::chrono::system_clock::now();
-            const auto now_sec =
-                std::chrono::time_point_cast<std::chrono::seconds>(now);
+        private:
+            std::atomic<bool> _requested;
+            std::mutex _mutex;
+            std::condition_variable _cv;
+        };
 
-            // printf("running\n");
-            _log_buffer.swap_buffer();
+        // Small numbers of the logging threads, and their names set once per thread.
+        // The backend copies the names when they change.
+        class ThreadRegistry {
+        public:
+            static inline ThreadRegistry& instance() {
+                static ThreadRegistry registry;
+                return registry;
+            }
 
-            while (!_log_buffer.empty()) {
-                _log_buffer.dequeue_with_time(now_sec);
+            // From 1, wrapping around after 65535 threads
+            inline uint16_t next_index() {
+                return static_cast<uint16_t>(1 + _next.fetch_add(1, std::memory_order_relaxed) % 65535);
             }
-        }
 
-        // bool with_time_stamp;
+            inline void set_name(uint16_t index, std::string name) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (_names.size() <= index) {
+                    _names.resize(index + 1);
+                }
+                _names[index] = name;
+                _crash_names.push_back(CrashName{index, std::move(name), nullptr});
+                _version.fetch_add(1, std::memory_order_release);
 
-        template <typename... Args>
-        void enqueue(LogLevel level, const char* fmt_str, const Args&... args) {
-            _log_buffer.enqueue(level, fmt_str, args...);
-        }
+                CrashName& crash_name = _crash_names.back();
+                crash_name.next = _last_crash_name.load(std::memory_order_relaxed);
+                _last_crash_name.store(&crash_name, std::memory_order_release);
+            }
+
+            // Changes with every name set
+            inline uint64_t version() const { return _version.load(std::memory_order_acquire); }
+
+            inline std::vector<std::string> names() {
+                std::lock_guard<std::mutex> lock(_mutex);
+                return _names;
+            }
+
+            // The name last set for the index, empty if none. Does not lock, for the crash
+            // handler.
+            inline fmt::string_view crash_name(uint16_t index) const {
+                for (const CrashName* it = _last_crash_name.load(std::memory_order_acquire);
+                     it != nullptr; it = it->next) {
+                    if (it->index == index) {
+                        return fmt::string_view(it->name.data(), it->name.size());
+                    }
+                }
+                return {};
+            }
 
-        void dequeue() { _log_buffer.dequeue(); }
+        private:
+            // Every name set, newest first, never freed so that the crash handler can walk them
+            struct CrashName {
+                uint16_t index;
+                std::string name;
+                const CrashName* next;
+            };
+
+            ThreadRegistry() : _next(0), _version(0), _last_crash_name(nullptr) {}
+
+            std::atomic<uint32_t> _next;
+            std::atomic<uint64_t> _version;
+            std::mutex _mutex;
+            std::vector<std::string> _names;
+            std::deque<CrashName> _crash_names;
+            std::atomic<const CrashName*> _last_crash_name;
+        };
 
-        void dequeue_with_time(
-            const std::chrono::time_point<std::chrono::system_clock,
-                                          std::chrono::seconds>& time_point) {
-            _log_buffer.dequeue_with_time(time_point);
+        // Numbered on the first call, which the queue of the thread makes
+        inline uint16_t current_thread_index() {
+            static thread_local const uint16_t index = ThreadRegistry::instance().next_index();
+            return index;
         }
 
-    protected:
-    private:
-        Logger()
-            : // with_time_stamp(true),
-              _run(true),
-              _thread([&]() {
-                  while (_run.load()) {
-#if EFP_LOG_TIME_STAMP == true
-                      process_with_time();
+        // Storage of a queue, written once so that the first records do not page fault.
+        // Mapped instead of allocated to be locked in RAM or backed by huge pages.
+        class QueueMemory {
+        public:
+            QueueMemory(size_t size, bool lock, bool huge_pages)
+                : _data(nullptr), _mapped_size(0), _locked(false), _huge_pages(false) {
+#if defined(__unix__) || defined(__APPLE__)
+                if (lock || huge_pages) {
+                    map(size, huge_pages);
+                }
+                if (_data != nullptr && lock) {
+                    _locked = mlock(_data, _mapped_size) == 0;
+                }
 #else
-                      process();
+                (void)lock;
+                (void)huge_pages;
 #endif
-                      // todo periodic
-                      std::this_thread::sleep_for(std::chrono::milliseconds{1});
-                  }
-              }) {
-        }
+                if (_data == nullptr) {
+                    _heap.reset(new uint64_t[(size + sizeof(uint64_t) - 1) / sizeof(uint64_t)]);
+                    _data = reinterpret_cast<char*>(_heap.get());
+                }
+                std::memset(_data, 0, size);
+            }
 
-        LogLevel _log_level;
+            ~QueueMemory() {
+#if defined(__unix__) || defined(__APPLE__)
+                if (_mapped_size != 0) {
+                    munmap(_data, _mapped_size);
+                }
+#endif
+            }
 
-        detail::LogBuffer _log_buffer;
+            QueueMemory(const QueueMemory& other) = delete;
+            QueueMemory& operator=(const QueueMemory& other) = delete;
 
-        std::atomic<bool> _run;
-        std::thread _thread;
-    };
+            inline char* data() const { return _data; }
 
-    // LogLevel Logger::instance().log_level = LogLevel::Debug;
+            inline bool locked() const { return _locked; }
 
-    namespace detail {
+            inline bool huge_pages() const { return _huge_pages; }
 
-        template <typename... Args>
-        inline void enqueue_log(LogLevel level, const char* fmt_str,
-                                const Args&... args) {
-            if (level >= Logger::get_log_level()) {
-                Logger::instance().enqueue(level, fmt_str, args...);
+        private:
+#if defined(__unix__) || defined(__APPLE__)
+            inline void map(size_t size, bool huge_pages) {
+#if defined(MAP_HUGETLB)
+                if (huge_pages) {
+                    const size_t huge_page_size = 2 << 20;
+                    const size_t huge_size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+                    void* data = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                    if (data != MAP_FAILED) {
+                        _data = static_cast<char*>(data);
+                        _mapped_size = huge_size;
+                        _huge_pages = true;
+                        return;
+                    }
+                }
+#endif
+                void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                                  -1, 0);
+                if (data == MAP_FAILED) {
+                    return;
+                }
+                _data = static_cast<char*>(data);
+                _mapped_size = size;
+#if defined(MADV_HUGEPAGE)
+                // Before the pages are touched
+                _huge_pages = huge_pages && madvise(data, size, MADV_HUGEPAGE) == 0;
+#endif
             }
-        }
-    } // namespace detail
+#endif
 
-    template <typename... Args>
-    inline void trace(const char* fmt_str, const Args&... args) {
-        detail::enqueue_log(LogLevel::Trace, fmt_str, args...);
-    }
+            char* _data;
+            size_t _mapped_size;
+            std::unique_ptr<uint64_t[]> _heap;
+            bool _locked;
+            bool _huge_pages;
+        };
 
-    template <typename... Args>
-    inline void debug(const char* fmt_str, const Args&... args) {
-        detail::enqueue_log(LogLevel::Debug, fmt_str, args...);
-    }
+        // Wait-free single-producer single-consumer ring of variable length records.
+        // Each record is written into one contiguous reservation and published with commit(),
+        // so the consumer never observes a partially written record.
+        // Records have to start with their uint32_t size and be multiple of record_alignment.
+        // With overwrite, the producer may also advance the head to reclaim the oldest records.
+        // The consumer then has to copy a record out and claim it with claim_front().
+        class SpscByteRing {
+        public:
+            SpscByteRing(size_t capacity, bool overwrite, bool lock_memory = false,
+                         bool huge_pages = false)
+                : _head(0),
+                  _tail(0),
+                  _write_pos(0),
+                  _head_cache(0),
+                  _reserved(0),
+                  _capacity(capacity),
+                  _mask(capacity - 1),
+                  _overwrite(overwrite),
+                  _memory(capacity, lock_memory, huge_pages),
+                  _buffer(_memory.data()) {}
 
-    template <typename... Args>
-    inline void info(const char* fmt_str, const Args&... args) {
-        detail::enqueue_log(LogLevel::Info, fmt_str, args...);
+            SpscByteRing(const SpscByteRing& other) = delete;
+            SpscByteRing& operator=(const SpscByteRing& other) = delete;
+
+            inline size_t capacity() const { return _capacity; }
+
+            inline bool overwrite() const { return _overwrite; }
+
+            inline const QueueMemory& memory() const { return _memory; }
+
+            // Producer side
+
+            // Whether a record of the size can be reserved once the ring is drained
+            inline bool fits(size_t size) const { return size <= _capacity; }
+
+            // Returns nullptr if there is not enough space
+            inline char* try_reserve(size_t size) {
+                const size_t needed = needed_size(size);
+
+                if (_write_pos + needed - _head_cache > _capacity) {
+                    _head_cache = _head.load(std::memory_order_acquire);
+                    if (_write_pos + needed - _head_cache > _capacity) {
+                        // A record which has to wrap fits from offset 0 of an empty ring
+                        if (_head_cache != _write_pos || !fits(size)) {
+                            return nullptr;
+                        }
+                        restart();
+                    }
+                }
+
+                return place(size);
+            }
+
+            // Reclaims the oldest records until the new one fits, adding their number to overwritten.
+            // Returns nullptr only if the record can not fit at all.
+            inline char* reserve_overwrite(size_t size, size_t& overwritten) {
+                if (!fits(size)) {
+                    return nullptr;
+                }
+
+                size_t head_pos = _head.load(std::memory_order_acquire);
+                while (_write_pos + needed_size(size) - head_pos > _capacity) {
+                    if (head_pos == _write_pos) {
+                        restart();
+                        head_pos = _write_pos;
+                        break;
+                    }
+
+                    const uint32_t record_size = record_size_at(head_pos);
+                    const size_t next = record_size == 0
+                                            ? head_pos + _capacity - (head_pos & _mask)
+                                            : head_pos + record_size;
+
+                    if (_head.compare_exchange_weak(head_pos, next, std::memory_order_acq_rel,
+                                                    std::memory_order_acquire)) {
+                        overwritten += record_size == 0 ? 0 : 1;
+                        head_pos = next;
+                    }
+                }
+                _head_cache = head_pos;
+
+                return place(size);
+            }
+
+            inline void commit() {
+                _write_pos += _reserved;
+                _tail.store(_write_pos, std::memory_order_release);
+            }
+
+            // Bytes in use as last seen by the producer. Never less than the actual.
+            inline size_t cached_used() const { return _write_pos - _head_cache; }
+
+            inline size_t refresh_used() {
+                _head_cache = _head.load(std::memory_order_acquire);
+                return _write_pos - _head_cache;
+            }
+
+            // Consumer side
+
+            inline size_t head() const { return _head.load(std::memory_order_acquire); }
+
+            inline size_t tail() const { return _tail.load(std::memory_order_acquire); }
+
+            // Only valid if head() < tail(). With overwrite the content may change until claimed.
+            inline const char* front() {
+                size_t head_pos = head();
+                if (record_size_at(head_pos) == 0) {
+                    skip_wrap(head_pos);
+                    head_pos = head();
+                }
+                return &_buffer[head_pos & _mask];
+            }
+
+            // Only without overwrite
+            inline void pop_front() {
+                const size_t head_pos = head();
+                _head.store(head_pos + record_size_at(head_pos), std::memory_order_release);
+            }
+
+            // Only with overwrite. Copies the oldest record before end into scratch and pops it.
+            // Returns nullptr if every record before end has been overwritten.
+            inline const char* claim_front(char* scratch, size_t end) {
+                size_t head_pos = head();
+                while (head_pos < end) {
+                    const size_t offset = head_pos & _mask;
+                    const uint32_t size = record_size_at(head_pos);
+
+                    if (size == 0) {
+                        skip_wrap(head_pos);
+                        head_pos = head();
+                        continue;
+                    }
+
+                    // A torn read while the producer reclaims this record
+                    if (size > _capacity - offset || size % record_alignment != 0) {
+                        head_pos = head();
+                        continue;
+                    }
+
+                    std::memcpy(scratch, &_buffer[offset], size);
+                    if (_head.compare_exchange_strong(head_pos, head_pos + size,
+                                                      std::memory_order_acq_rel,
+                                                      std::memory_order_acquire)) {
+                        return scratch;
+                    }
+                }
+                return nullptr;
+            }
+
+        private:
+            inline size_t needed_size(size_t size) const {
+                const size_t contiguous = _capacity - (_write_pos & _mask);
+                return size <= contiguous ? size : contiguous + size;
+            }
+
+            // Moves an empty ring to offset 0. The consumer reads the head before a record, so
+            // the head goes first and no stale record is seen between the two stores.
+            inline void restart() {
+                _write_pos += _capacity - (_write_pos & _mask);
+                _head.store(_write_pos, std::memory_order_release);
+                _tail.store(_write_pos, std::memory_order_release);
+                _head_cache = _write_pos;
+            }
+
+            inline char* place(size_t size) {
+                const size_t offset = _write_pos & _mask;
+                const size_t contiguous = _capacity - offset;
+
+                if (size > contiguous) {
+                    // Zero size marks the rest of the ring unused
+                    const uint32_t wrap = 0;
+                    std::memcpy(&_buffer[offset], &wrap, sizeof(uint32_t));
+                    _write_pos += contiguous;
+                }
+
+                _reserved = size;
+                return &_buffer[_write_pos & _mask];
+            }
+
+            inline void skip_wrap(size_t head_pos) {
+                const size_t next = head_pos + _capacity - (head_pos & _mask);
+                if (_overwrite) {
+                    // Fails only if the producer already moved the head
+                    _head.compare_exchange_strong(head_pos, next, std::memory_order_acq_rel,
+                                                  std::memory_order_acquire);
+                } else {
+                    _head.store(next, std::memory_order_release);
+                }
+            }
+
+            inline uint32_t record_size_at(size_t pos) const {
+                uint32_t size;
+                std::memcpy(&size, &_buffer[pos & _mask], sizeof(uint32_t));
+                return size;
+            }
+
+            // Producer and consumer indices live on separate cache lines
+            std::atomic<size_t> _head;
+            char _head_padding[EFP_LOG_CACHE_LINE - sizeof(std::atomic<size_t>)];
+            std::atomic<size_t> _tail;
+            size_t _write_pos;
+            size_t _head_cache;
+            size_t _reserved;
+            char _tail_padding[EFP_LOG_CACHE_LINE - sizeof(std::atomic<size_t>) - 3 * sizeof(size_t)];
+
+            const size_t _capacity;
+            const size_t _mask;
+            const bool _overwrite;
+            QueueMemory _memory;
+            char* _buffer;
+        };
+
+        // Increment of a counter with a single writer, without a locked instruction
+        inline void add_relaxed(std::atomic<uint64_t>& counter, uint64_t n) {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        inline void max_relaxed(std::atomic<uint64_t>& counter, uint64_t n) {
+            if (n > counter.load(std::memory_order_relaxed)) {
+                counter.store(n, std::memory_order_relaxed);
+            }
+        }
+
+        // Queue owned by one producer thread. Retired when the thread exits and
+        // reclaimed by the backend once it has been drained.
+        // Applies the overflow policy without allocation.
+        class LogQueue : public SpscByteRing {
+        public:
+            LogQueue(const LoggerConfig& config, WakeupSignal& wakeup)
+                : SpscByteRing(ceil_pow2(config.queue_capacity < 2 * EFP_LOG_CACHE_LINE
+                                             ? 2 * EFP_LOG_CACHE_LINE
+                                             : config.queue_capacity),
+                               config.overflow_policy == OverflowPolicy::OverwriteOldest,
+                               config.lock_queue_memory, config.huge_page_queues),
+                  _memory_failed((config.lock_queue_memory && !memory().locked()) ||
+                                 (config.huge_page_queues && !memory().huge_pages())),
+                  _policy(config.overflow_policy),
+                  _block_spin_num(config.block_spin_num),
+                  _wakeup_size(capacity() / 100 * config.wakeup_fill_percent),
+                  _wakeup(wakeup),
+                  _dropped(0),
+                  _retired(false),
+                  _thread_id(std::this_thread::get_id()),
+                  _thread_index(current_thread_index()),
+                  _overwritten(0),
+                  _high_water(0) {
+                for (size_t i = 0; i < log_level_num; ++i) {
+                    _enqueued[i].store(0, std::memory_order_relaxed);
+                    _level_dropped[i].store(0, std::memory_order_relaxed);
+                }
+            }
+
+            // Returns nullptr if the record is dropped
+            inline char* reserve(size_t size) {
+                char* record = nullptr;
+
+                switch (_policy) {
+                case OverflowPolicy::Block: {
+                    // A record which can never fit is dropped instead of waited for
+                    size_t spin_num = 0;
+                    while (fits(size) && (record = try_reserve(size)) == nullptr) {
+                        if (spin_num == 0 && _wakeup_size != 0) {
+                            _wakeup.notify();
+                        }
+                        if (spin_num < _block_spin_num) {
+                            ++spin_num;
+                        } else {
+                            std::this_thread::yield();
+                        }
+                    }
+                    break;
+                }
+                case OverflowPolicy::OverwriteOldest: {
+                    size_t overwritten = 0;
+                    record = reserve_overwrite(size, overwritten);
+                    add_dropped(overwritten);
+                    add_relaxed(_overwritten, overwritten);
+                    break;
+                }
+                default:
+                    record = try_reserve(size);
+                    break;
+                }
+
+                if (record == nullptr) {
+                    add_dropped(1);
+                    if (_wakeup_size != 0) {
+                        _wakeup.notify();
+                    }
+                }
+                return record;
+            }
+
+            // Publishes the record and wakes the backend above the fill threshold.
+            // Below it, only producer local state is read.
+            inline void commit() {
+                SpscByteRing::commit();
+                if (_wakeup_size != 0 && cached_used() >= _wakeup_size &&
+                    refresh_used() >= _wakeup_size) {
+                    _wakeup.notify();
+                }
+            }
+
+            inline uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+            // Of the producer thread, written into each record
+            inline uint16_t thread_index() const { return _thread_index; }
+
+            // Whether the memory could not be locked or backed by huge pages as configured
+            inline bool memory_failed() const { return _memory_failed; }
+
+            inline void retire() { _retired.store(true, std::memory_order_release); }
+
+            inline bool retired() const { return _retired.load(std::memory_order_acquire); }
+
+            // Producer side counters, after the record is committed or dropped
+            inline void count_enqueued(LogLevel level) {
+                add_relaxed(_enqueued[static_cast<size_t>(level)], 1);
+            }
+
+            inline void count_dropped(LogLevel level) {
+                add_relaxed(_level_dropped[static_cast<size_t>(level)], 1);
+            }
+
+            // Called by the backend with the fill at a snapshot
+            inline void sample_high_water(size_t used) { max_relaxed(_high_water, used); }
+
+            inline QueueStats stats() const {
+                QueueStats stats;
+                stats.thread_id = _thread_id;
+                stats.capacity = capacity();
+                stats.high_water = static_cast<size_t>(_high_water.load(std::memory_order_relaxed));
+                for (size_t i = 0; i < log_level_num; ++i) {
+                    stats.enqueued[i] = _enqueued[i].load(std::memory_order_relaxed);
+                    stats.dropped[i] = _level_dropped[i].load(std::memory_order_relaxed);
+                }
+                stats.overwritten = _overwritten.load(std::memory_order_relaxed);
+                return stats;
+            }
+
+        private:
+            // Written only by the producer
+            inline void add_dropped(uint64_t n) {
+                if (n != 0) {
+                    add_relaxed(_dropped, n);
+                }
+            }
+
+            const bool _memory_failed;
+            const OverflowPolicy _policy;
+            const size_t _block_spin_num;
+            const size_t _wakeup_size;
+            WakeupSignal& _wakeup;
+            std::atomic<uint64_t> _dropped;
+            std::atomic<bool> _retired;
+            const std::thread::id _thread_id;
+            const uint16_t _thread_index;
+            std::atomic<uint64_t> _enqueued[log_level_num];
+            std::atomic<uint64_t> _level_dropped[log_level_num];
+            std::atomic<uint64_t> _overwritten;
+            std::atomic<uint64_t> _high_water;
+        };
+
+        inline RecordHeader record_header(const char* record) {
+            RecordHeader header;
+            std::memcpy(&header, record, sizeof(RecordHeader));
+            return header;
+        }
+
+        // Decodes one argument and passes it to f. Strings are passed as fmt::string_view and
+        // custom arguments as CustomValue, which stay valid as long as the payload.
+        // Returns the end of the argument.
+        template <typename F>
+        inline const char* visit_arg(ArgType arg_type, const char* payload, F& f) {
+            switch (arg_type) {
+            case ArgType::Int:
+                f(decode_arg<int>(payload));
+                break;
+            case ArgType::Short:
+                f(decode_arg<short>(payload));
+                break;
+            case ArgType::Long:
+                f(decode_arg<long>(payload));
+                break;
+            case ArgType::LongLong:
+                f(decode_arg<long long>(payload));
+                break;
+            case ArgType::UInt:
+                f(decode_arg<unsigned int>(payload));
+                break;
+            case ArgType::UShort:
+                f(decode_arg<unsigned short>(payload));
+                break;
+            case ArgType::ULong:
+                f(decode_arg<unsigned long>(payload));
+                break;
+            case ArgType::ULongLong:
+                f(decode_arg<unsigned long long>(payload));
+                break;
+            case ArgType::Char:
+                f(decode_arg<char>(payload));
+                break;
+            case ArgType::SChar:
+                f(decode_arg<signed char>(payload));
+                break;
+            case ArgType::UChar:
+                f(decode_arg<unsigned char>(payload));
+                break;
+            case ArgType::Bool:
+                f(decode_arg<bool>(payload));
+                break;
+            case ArgType::Float:
+                f(decode_arg<float>(payload));
+                break;
+            case ArgType::Double:
+                f(decode_arg<double>(payload));
+                break;
+            case ArgType::LongDouble:
+                f(decode_arg<long double>(payload));
+                break;
+            case ArgType::CStr:
+                f(decode_arg<const char*>(payload));
+                break;
+            case ArgType::Pointer:
+                f(decode_arg<void*>(payload));
+                break;
+            case ArgType::StlString:
+                f(decode_string(payload));
+                break;
+            case ArgType::Custom:
+                f(decode_custom(payload));
+                break;
+            default:
+                fmt::println("Potential error. this messege should not be displayed");
+                break;
+            }
+            return payload;
+        }
+
+        struct StringValue {
+            const char* data;
+            size_t size;
+        };
+
+        // Decoded argument, narrowed to the types fmt formats natively as fmt's own argument
+        // mapping does, so the specs behave the same as with fmt::format
+        struct ArgValue {
+            enum class Kind : uint8_t {
+                Int,
+                UInt,
+                LongLong,
+                ULongLong,
+                Bool,
+                Char,
+                Float,
+                Double,
+                LongDouble,
+                CStr,
+                String,
+                Pointer,
+                Custom,
+            };
+
+            Kind kind;
+            union {
+                int int_value;
+                unsigned int uint_value;
+                long long long_long_value;
+                unsigned long long ulong_long_value;
+                bool bool_value;
+                char char_value;
+                float float_value;
+                double double_value;
+                long double long_double_value;
+                const char* cstr_value;
+                StringValue string_value;
+                const void* pointer_value;
+                CustomValue custom_value;
+            };
+        };
+
+#define EFP_LOG_ARG_VALUE_(type, kind_, member)        \
+    inline ArgValue make_arg_value(type value) {       \
+        ArgValue arg;                                  \
+        arg.kind = ArgValue::Kind::kind_;              \
+        arg.member = value;                            \
+        return arg;                                    \
+    }
+
+        EFP_LOG_ARG_VALUE_(int, Int, int_value)
+        EFP_LOG_ARG_VALUE_(short, Int, int_value)
+        EFP_LOG_ARG_VALUE_(signed char, Int, int_value)
+        EFP_LOG_ARG_VALUE_(unsigned int, UInt, uint_value)
+        EFP_LOG_ARG_VALUE_(unsigned short, UInt, uint_value)
+        EFP_LOG_ARG_VALUE_(unsigned char, UInt, uint_value)
+        EFP_LOG_ARG_VALUE_(long long, LongLong, long_long_value)
+        EFP_LOG_ARG_VALUE_(unsigned long long, ULongLong, ulong_long_value)
+        EFP_LOG_ARG_VALUE_(bool, Bool, bool_value)
+        EFP_LOG_ARG_VALUE_(char, Char, char_value)
+        EFP_LOG_ARG_VALUE_(float, Float, float_value)
+        EFP_LOG_ARG_VALUE_(double, Double, double_value)
+        EFP_LOG_ARG_VALUE_(long double, LongDouble, long_double_value)
+        EFP_LOG_ARG_VALUE_(const char*, CStr, cstr_value)
+        EFP_LOG_ARG_VALUE_(void*, Pointer, pointer_value)
+
+#undef EFP_LOG_ARG_VALUE_
+
+        inline ArgValue make_arg_value(long value) {
+            return sizeof(long) == sizeof(int) ? make_arg_value(static_cast<int>(value))
+                                               : make_arg_value(static_cast<long long>(value));
+        }
+
+        inline ArgValue make_arg_value(unsigned long value) {
+            return sizeof(unsigned long) == sizeof(unsigned int)
+                       ? make_arg_value(static_cast<unsigned int>(value))
+                       : make_arg_value(static_cast<unsigned long long>(value));
+        }
+
+        inline ArgValue make_arg_value(fmt::string_view value) {
+            ArgValue arg;
+            arg.kind = ArgValue::Kind::String;
+            arg.string_value = StringValue{value.data(), value.size()};
+            return arg;
+        }
+
+        inline ArgValue make_arg_value(const CustomValue& value) {
+            ArgValue arg;
+            arg.kind = ArgValue::Kind::Custom;
+            arg.custom_value = value;
+            return arg;
+        }
+
+        struct ArgValueCollector {
+            ArgValue* values;
+            size_t size;
+
+            template <typename A>
+            void operator()(const A& arg) { values[size++] = make_arg_value(arg); }
+        };
+
+        struct FieldValue {
+            fmt::string_view key;
+            ArgValue value;
+        };
+
+        template <typename T>
+        inline void format_value(fmt::memory_buffer& out, const T& value, fmt::string_view spec) {
+            // fmt writes a lone "{}" without going through the spec parser
+            if (spec.size() == 0) {
+                fmt::format_to(fmt::appender(out), "{}", value);
+                return;
+            }
+
+            fmt::formatter<T> formatter;
+            fmt::format_parse_context parse_ctx(spec);
+            parse_ctx.advance_to(formatter.parse(parse_ctx));
+            fmt::format_context ctx(fmt::appender(out), {});
+            formatter.format(value, ctx);
+        }
+
+        inline void format_arg_value(fmt::memory_buffer& out, const ArgValue& arg,
+                                     fmt::string_view spec) {
+            switch (arg.kind) {
+            case ArgValue::Kind::Int:
+                format_value(out, arg.int_value, spec);
+                break;
+            case ArgValue::Kind::UInt:
+                format_value(out, arg.uint_value, spec);
+                break;
+            case ArgValue::Kind::LongLong:
+                format_value(out, arg.long_long_value, spec);
+                break;
+            case ArgValue::Kind::ULongLong:
+                format_value(out, arg.ulong_long_value, spec);
+                break;
+            case ArgValue::Kind::Bool:
+                format_value(out, arg.bool_value, spec);
+                break;
+            case ArgValue::Kind::Char:
+                format_value(out, arg.char_value, spec);
+                break;
+            case ArgValue::Kind::Float:
+                format_value(out, arg.float_value, spec);
+                break;
+            case ArgValue::Kind::Double:
+                format_value(out, arg.double_value, spec);
+                break;
+            case ArgValue::Kind::LongDouble:
+                format_value(out, arg.long_double_value, spec);
+                break;
+            case ArgValue::Kind::CStr:
+                format_value(out, arg.cstr_value, spec);
+                break;
+            case ArgValue::Kind::String:
+                format_value(out, fmt::string_view(arg.string_value.data, arg.string_value.size),
+                             spec);
+                break;
+            case ArgValue::Kind::Pointer:
+                format_value(out, arg.pointer_value, spec);
+                break;
+            case ArgValue::Kind::Custom:
+                arg.custom_value.codec->format(out, arg.custom_value.data, arg.custom_value.size,
+                                               spec);
+                break;
+            }
+        }
+
+        // One descriptor per user type, whose address is stored in the record
+        template <typename T>
+        struct CustomArgOf {
+            static void format(fmt::memory_buffer& out, const char* data, size_t size,
+                               fmt::string_view spec) {
+                format_value(out, LogCodec<T>::decode(data, size), spec);
+            }
+
+            static const CustomArgCodec codec;
+        };
+
+        template <typename T>
+        const CustomArgCodec CustomArgOf<T>::codec{&CustomArgOf<T>::format};
+
+        // Literal text followed by an optional replacement field
+        struct FormatSegment {
+            fmt::string_view literal;
+            // The replacement field with its braces, printed if the argument does not suit it
+            fmt::string_view field;
+            // -1 for a literal only segment
+            int arg_id;
+            // Format spec without the colon. Nested fields are kept as they are
+            // and replaced by the value of nested_ids on rendering.
+            fmt::string_view spec;
+            uint8_t nested_num;
+            int nested_ids[2];
+        };
+
+        struct ParsedFormat {
+            std::vector<FormatSegment> segments;
+            int max_arg_id;
+            bool valid;
+        };
+
+        // Returns false on a malformed id
+        inline bool parse_arg_id(const char*& it, const char* end, int& next_id, int& arg_id) {
+            if (it != end && *it >= '0' && *it <= '9') {
+                arg_id = 0;
+                while (it != end && *it >= '0' && *it <= '9') {
+                    arg_id = arg_id * 10 + (*it - '0');
+                    if (arg_id > 255) {
+                        return false;
+                    }
+                    ++it;
+                }
+            } else {
+                arg_id = next_id++;
+            }
+            return it != end && (*it == ':' || *it == '}');
+        }
+
+        // Splits a format string in the fmt syntax into segments once, so rendering a record
+        // only formats the arguments. Named arguments are not supported.
+        inline ParsedFormat parse_format(fmt::string_view fmt_str) {
+            ParsedFormat parsed{{}, -1, false};
+
+            const char* it = fmt_str.data();
+            const char* const end = it + fmt_str.size();
+            const char* literal_begin = it;
+            int next_id = 0;
+
+            auto push_literal = [&](const char* literal_end) {
+                if (literal_end != literal_begin) {
+                    parsed.segments.push_back(FormatSegment{
+                        fmt::string_view(literal_begin, static_cast<size_t>(literal_end - literal_begin)),
+                        {}, -1, {}, 0, {0, 0}});
+                }
+            };
+
+            while (it != end) {
+                const char c = *it;
+                if (c != '{' && c != '}') {
+                    ++it;
+                    continue;
+                }
+
+                // Escaped brace, keeps one of the pair
+                if (it + 1 != end && it[1] == c) {
+                    push_literal(it + 1);
+                    it += 2;
+                    literal_begin = it;
+                    continue;
+                }
+
+                if (c == '}') {
+                    return parsed;
+                }
+
+                FormatSegment segment{
+                    fmt::string_view(literal_begin, static_cast<size_t>(it - literal_begin)),
+                    {}, -1, {}, 0, {0, 0}};
+                const char* const field_begin = it;
+                ++it;
+
+                if (!parse_arg_id(it, end, next_id, segment.arg_id)) {
+                    return parsed;
+                }
+
+                if (*it == ':') {
+                    const char* spec_begin = ++it;
+                    while (it != end && *it != '}') {
+                        if (*it == '{') {
+                            ++it;
+                            if (segment.nested_num == 2 ||
+                                !parse_arg_id(it, end, next_id,
+                                              segment.nested_ids[segment.nested_num]) ||
+                                *it != '}') {
+                                return parsed;
+                            }
+                            ++segment.nested_num;
+                        }
+                        ++it;
+                    }
+                    if (it == end) {
+                        return parsed;
+                    }
+                    segment.spec = fmt::string_view(spec_begin, static_cast<size_t>(it - spec_begin));
+                }
+
+                ++it;
+                segment.field = fmt::string_view(field_begin, static_cast<size_t>(it - field_begin));
+                literal_begin = it;
+
+                parsed.max_arg_id = segment.arg_id > parsed.max_arg_id ? segment.arg_id
+                                                                       : parsed.max_arg_id;
+                for (uint8_t i = 0; i < segment.nested_num; ++i) {
+                    parsed.max_arg_id = segment.nested_ids[i] > parsed.max_arg_id
+                                            ? segment.nested_ids[i]
+                                            : parsed.max_arg_id;
+                }
+                parsed.segments.push_back(segment);
+            }
+
+            push_literal(end);
+            parsed.valid = true;
+            return parsed;
+        }
+
+        inline void render_field(fmt::memory_buffer& out, const FormatSegment& segment,
+                                 const ArgValue* args) {
+            if (segment.nested_num == 0) {
+                format_arg_value(out, args[segment.arg_id], segment.spec);
+                return;
+            }
+
+            // Dynamic width or precision. A non integer value is rejected by the spec parser.
+            fmt::memory_buffer spec;
+            uint8_t nested_i = 0;
+            const char* it = segment.spec.data();
+            const char* const end = it + segment.spec.size();
+            while (it != end) {
+                if (*it == '{') {
+                    format_arg_value(spec, args[segment.nested_ids[nested_i++]], {});
+                    while (*it != '}') {
+                        ++it;
+                    }
+                } else {
+                    spec.push_back(*it);
+                }
+                ++it;
+            }
+            format_arg_value(out, args[segment.arg_id], fmt::string_view(spec.data(), spec.size()));
+        }
+
+        // Format strings which failed to parse or refer to missing arguments are printed
+        // as they are. So is a field whose spec does not suit its argument, which fmt rejects
+        // by throwing, or whose user formatter throws.
+        inline void render_format(fmt::memory_buffer& out, const ParsedFormat& parsed,
+                                  fmt::string_view fmt_str, const ArgValue* args, size_t arg_num) {
+            if (!parsed.valid || parsed.max_arg_id >= static_cast<int>(arg_num)) {
+                append(out, fmt_str);
+                return;
+            }
+
+            for (const FormatSegment& segment : parsed.segments) {
+                append(out, segment.literal);
+                if (segment.arg_id < 0) {
+                    continue;
+                }
+
+#if FMT_EXCEPTIONS
+                const size_t field_begin = out.size();
+                try {
+                    render_field(out, segment, args);
+                } catch (const std::exception&) {
+                    out.resize(field_begin);
+                    append(out, segment.field);
+                }
+#else
+                render_field(out, segment, args);
+#endif
+            }
+        }
+
+        inline void append_json_string(fmt::memory_buffer& out, fmt::string_view str) {
+            static const char hex_digits[] = "0123456789abcdef";
+
+            out.push_back('"');
+            const char* begin = str.data();
+            const char* const end = begin + str.size();
+            for (const char* it = begin; it != end; ++it) {
+                const unsigned char c = static_cast<unsigned char>(*it);
+                if (c >= 0x20 && c != '"' && c != '\\') {
+                    continue;
+                }
+
+                out.append(begin, it);
+                begin = it + 1;
+                switch (c) {
+                case '"':
+                    append(out, "\\\"");
+                    break;
+                case '\\':
+                    append(out, "\\\\");
+                    break;
+                case '\n':
+                    append(out, "\\n");
+                    break;
+                case '\r':
+                    append(out, "\\r");
+                    break;
+                case '\t':
+                    append(out, "\\t");
+                    break;
+                default: {
+                    const char escaped[] = {'\\', 'u', '0', '0', hex_digits[c >> 4], hex_digits[c & 0xf]};
+                    out.append(escaped, escaped + sizeof(escaped));
+                    break;
+                }
+                }
+            }
+            out.append(begin, end);
+            out.push_back('"');
+        }
+
+        inline fmt::string_view arg_value_string(const ArgValue& arg) {
+            return arg.kind == ArgValue::Kind::CStr
+                       ? fmt::string_view(arg.cstr_value)
+                       : fmt::string_view(arg.string_value.data, arg.string_value.size);
+        }
+
+        // Numbers and booleans as they are, everything else as a string
+        inline void append_json_value(fmt::memory_buffer& out, const ArgValue& arg) {
+            switch (arg.kind) {
+            case ArgValue::Kind::Int:
+            case ArgValue::Kind::UInt:
+            case ArgValue::Kind::LongLong:
+            case ArgValue::Kind::ULongLong:
+            case ArgValue::Kind::Bool:
+                format_arg_value(out, arg, {});
+                break;
+            case ArgValue::Kind::Float:
+            case ArgValue::Kind::Double:
+            case ArgValue::Kind::LongDouble: {
+                const size_t begin = out.size();
+                format_arg_value(out, arg, {});
+                // inf and nan are not JSON numbers
+                const char last = out.data()[out.size() - 1];
+                if (last == 'f' || last == 'n') {
+                    const std::string value(out.data() + begin, out.size() - begin);
+                    out.resize(begin);
+                    append_json_string(out, value);
+                }
+                break;
+            }
+            case ArgValue::Kind::Char:
+                append_json_string(out, fmt::string_view(&arg.char_value, 1));
+                break;
+            case ArgValue::Kind::CStr:
+            case ArgValue::Kind::String:
+                append_json_string(out, arg_value_string(arg));
+                break;
+            default: {
+                fmt::memory_buffer value;
+                format_arg_value(value, arg, {});
+                append_json_string(out, fmt::string_view(value.data(), value.size()));
+                break;
+            }
+            }
+        }
+
+        // Appended to the text message as " key=value". Strings which would not read back
+        // as one value are quoted.
+        inline void render_text_fields(fmt::memory_buffer& out, const FieldValue* fields,
+                                       size_t field_num) {
+            for (size_t i = 0; i < field_num; ++i) {
+                out.push_back(' ');
+                append(out, fields[i].key);
+                out.push_back('=');
+
+                const ArgValue& value = fields[i].value;
+                if (value.kind == ArgValue::Kind::CStr || value.kind == ArgValue::Kind::String) {
+                    const fmt::string_view str = arg_value_string(value);
+                    bool plain = str.size() != 0;
+                    for (const char c : str) {
+                        plain = plain && c > ' ' && c != '"' && c != '=';
+                    }
+                    if (!plain) {
+                        append_json_string(out, str);
+                        continue;
+                    }
+                }
+                format_arg_value(out, value, {});
+            }
+        }
+
+        // Whether the address is in a read-only segment of the executable or a loaded library,
+        // as string literals are. Such a format string cannot change at its address. Linux only.
+        inline bool in_read_only_image(const void* address) {
+#if defined(__linux__)
+            struct Search {
+                uintptr_t address;
+                bool found;
+            } search{reinterpret_cast<uintptr_t>(address), false};
+
+            dl_iterate_phdr(
+                [](dl_phdr_info* info, size_t, void* data) -> int {
+                    Search& search = *static_cast<Search*>(data);
+                    for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+                        const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+                        if (phdr.p_type != PT_LOAD || (phdr.p_flags & PF_W) != 0) {
+                            continue;
+                        }
+                        const uintptr_t begin = info->dlpi_addr + phdr.p_vaddr;
+                        if (search.address >= begin && search.address < begin + phdr.p_memsz) {
+                            search.found = true;
+                            return 1;
+                        }
+                    }
+                    return 0;
+                },
+                &search);
+            return search.found;
+#else
+            (void)address;
+            return false;
+#endif
+        }
+
+        // Keeps the parsed format strings by address, like the binary definitions.
+        // A record is decoded once and then rendered as text, JSON or both.
+        // Each entry parses its own copy of the string. A string from the record rather than
+        // its call site may be gone, and its address reused by another, so it is compared too
+        // unless it is a literal. Whether it is one is found once per entry.
+        class FormatCache {
+        public:
+            FormatCache() : _fmt_str(nullptr), _static_fmt(false), _arg_num(0), _field_num(0) {}
+
+            // Returns the end of the arguments
+            const char* decode(const char* fmt_str, bool static_fmt, uint8_t arg_num,
+                               const ArgType* arg_types, const char* payload) {
+                _fmt_str = fmt_str;
+                _static_fmt = static_fmt;
+
+                ArgValueCollector collector{_args, 0};
+                _field_num = 0;
+                for (uint8_t i = 0; i < arg_num; ++i) {
+                    const ArgType arg_type = arg_types[i];
+                    if (is_field(arg_type)) {
+                        FieldValue& field = _fields[_field_num++];
+                        field.key = decode_arg<const char*>(payload);
+                        ArgValueCollector value_collector{&field.value, 0};
+                        payload = visit_arg(field_value_type(arg_type), payload, value_collector);
+                    } else {
+                        payload = visit_arg(arg_type, payload, collector);
+                    }
+                }
+                _arg_num = collector.size;
+
+                return payload;
+            }
+
+            // Messages without positional arguments are printed as they are
+            void render_message(fmt::memory_buffer& out) {
+                if (_arg_num == 0) {
+                    append(out, _fmt_str);
+                    return;
+                }
+
+                auto it = _parsed.find(_fmt_str);
+                if (it == _parsed.end()) {
+                    it = _parsed.emplace(_fmt_str, Entry()).first;
+                    it->second.literal = _static_fmt || in_read_only_image(_fmt_str);
+                    it->second.assign(_fmt_str);
+                } else if (!it->second.literal && it->second.text != _fmt_str) {
+                    it->second.assign(_fmt_str);
+                }
+                render_format(out, it->second.parsed, it->second.text, _args, _arg_num);
+            }
+
+            void render_text(fmt::memory_buffer& out) {
+                render_message(out);
+                render_text_fields(out, _fields, _field_num);
+            }
+
+            // Members of the JSON object after the time and level
+            void render_json(fmt::memory_buffer& out) {
+                append(out, "\"message\":");
+                if (_arg_num == 0) {
+                    append_json_string(out, _fmt_str);
+                } else {
+                    _message.clear();
+                    render_message(_message);
+                    append_json_string(out, fmt::string_view(_message.data(), _message.size()));
+                }
+
+                for (size_t i = 0; i < _field_num; ++i) {
+                    out.push_back(',');
+                    append_json_string(out, _fields[i].key);
+                    out.push_back(':');
+                    append_json_value(out, _fields[i].value);
+                }
+            }
+
+        private:
+            // Kept in place by the map, as the segments point into the text
+            struct Entry {
+                std::string text;
+                ParsedFormat parsed;
+                // From the call site or in read-only memory, so never compared
+                bool literal;
+
+                void assign(const char* fmt_str) {
+                    text = fmt_str;
+                    parsed = parse_format(text);
+                }
+            };
+
+            std::unordered_map<const char*, Entry> _parsed;
+            const char* _fmt_str;
+            bool _static_fmt;
+            ArgValue _args[256];
+            size_t _arg_num;
+            FieldValue _fields[256];
+            size_t _field_num;
+            fmt::memory_buffer _message;
+        };
+
+        // Encoded size of fixed size argument types, 0 for strings and custom arguments
+        inline size_t fixed_arg_size(ArgType arg_type) {
+            switch (arg_type) {
+            case ArgType::Int:
+                return sizeof(int);
+            case ArgType::Short:
+                return sizeof(short);
+            case ArgType::Long:
+                return sizeof(long);
+            case ArgType::LongLong:
+                return sizeof(long long);
+            case ArgType::UInt:
+                return sizeof(unsigned int);
+            case ArgType::UShort:
+                return sizeof(unsigned short);
+            case ArgType::ULong:
+                return sizeof(unsigned long);
+            case ArgType::ULongLong:
+                return sizeof(unsigned long long);
+            case ArgType::Char:
+                return sizeof(char);
+            case ArgType::SChar:
+                return sizeof(signed char);
+            case ArgType::UChar:
+                return sizeof(unsigned char);
+            case ArgType::Bool:
+                return sizeof(bool);
+            case ArgType::Float:
+                return sizeof(float);
+            case ArgType::Double:
+                return sizeof(double);
+            case ArgType::LongDouble:
+                return sizeof(long double);
+            case ArgType::CStr:
+                return sizeof(const char*);
+            case ArgType::Pointer:
+                return sizeof(void*);
+            default:
+                return 0;
+            }
+        }
+
+        // Binary output layout, decoded by efp_logger_decode:
+        //   File header: binary_magic, uint8_t TimePrecision
+        //   Entries starting with a uint8_t BinaryTag
+        //     Definition: varint id, uint8_t arg_num, arg_num * uint8_t ArgType,
+        //                 varint size, format string
+        //     Record: varint id, uint8_t LogLevel,
+        //             zigzag varint wall clock ns delta to the previous record,
+        //             varint size, arguments
+        // Arguments are packed as in the queue, except CStr which is stored as
+        // uint32_t length and chars like StlString, and Custom which is stored the same way as
+        // its text, formatted with the spec of the first field which takes it. A kv() field,
+        // flagged with arg_field_flag, is its key stored the same way followed by the value.
+        // Fixed size arguments are in the byte order and sizes of the logging host.
+        // A file may hold several outputs back to back, as FileSink appends, sinks start a
+        // new output after a reset and loggers sharing a sink take turns. Each begins with the
+        // file header, in place of a tag, with its own definitions and deltas. A format string
+        // passed at run time that is replaced by another at the same address gets a new id.
+        enum class BinaryTag : uint8_t {
+            Definition = 1,
+            Record = 2,
+        };
+
+        constexpr char binary_magic[] = "EFPLOGB1";
+        constexpr size_t binary_magic_size = sizeof(binary_magic) - 1;
+
+        inline void append_varint(fmt::memory_buffer& out, uint64_t value) {
+            while (value >= 0x80) {
+                out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+                value >>= 7;
+            }
+            out.push_back(static_cast<char>(value));
+        }
+
+        inline uint64_t zigzag_encode(int64_t value) {
+            return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+        }
+
+        inline int64_t zigzag_decode(uint64_t value) {
+            return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+        }
+
+        // Writes each format string and argument type list once per output
+        class BinaryEncoder {
+        public:
+            BinaryEncoder()
+                : _precision(TimePrecision::Micro),
+                  _header_written(false),
+                  _last_wall_ns(0),
+                  _batch_definition_num(0),
+                  _batch_self_contained(false),
+                  _first_delta_begin(0),
+                  _first_delta_end(0),
+                  _first_wall_ns(0) {}
+
+            // Starts a new output, which needs the file header and definitions again
+            inline void reset() {
+                _definitions.clear();
+                _texts.clear();
+                _header_written = false;
+                _last_wall_ns = 0;
+            }
+
+            // Whether the batch begins with the file header, so needs nothing written before it
+            inline bool batch_self_contained() const { return _batch_self_contained; }
+
+            // Copies the batch into out as a new output. The header and the definitions made
+            // before the batch go first, and the first delta is taken from zero.
+            void restart(fmt::memory_buffer& out, const fmt::memory_buffer& batch) const {
+                out.append(binary_magic, binary_magic + binary_magic_size);
+                out.push_back(static_cast<char>(_precision));
+                for (size_t id = 0; id < _batch_definition_num; ++id) {
+                    append_definition(out, id, _texts[id].site, _texts[id].fmt_str.c_str());
+                }
+
+                out.append(batch.data(), batch.data() + _first_delta_begin);
+                append_varint(out, zigzag_encode(_first_wall_ns));
+                out.append(batch.data() + _first_delta_end, batch.data() + batch.size());
+            }
+
+            void encode(fmt::memory_buffer& out, TimePrecision precision, LogLevel level,
+                        int64_t wall_ns, const char* fmt_str, const CallSite* site,
+                        const char* payload) {
+                const bool batch_begin = out.size() == 0;
+                if (batch_begin) {
+                    _batch_definition_num = _texts.size();
+                    _batch_self_contained = !_header_written;
+                }
+
+                if (!_header_written) {
+                    out.append(binary_magic, binary_magic + binary_magic_size);
+                    out.push_back(static_cast<char>(precision));
+                    _precision = precision;
+                    _header_written = true;
+                }
+
+                const DefinitionKey key{fmt_str, site};
+                auto it = _definitions.find(key);
+                if (it == _definitions.end()) {
+                    const bool literal = site->fmt_str != nullptr || in_read_only_image(fmt_str);
+                    const Definition definition{define(out, site, fmt_str), literal};
+                    it = _definitions.emplace(key, definition).first;
+                } else if (!it->second.literal && _texts[it->second.id].fmt_str != fmt_str) {
+                    // The earlier id keeps its text for a restart of the batch
+                    it->second.id = define(out, site, fmt_str);
+                }
+
+                const DefinitionText& text = _texts[it->second.id];
+                if (!text.custom_fields.empty()) {
+                    collect_values(site, payload);
+                }
+
+                _args.clear();
+                size_t arg_id = 0;
+                for (uint8_t i = 0; i < site->arg_num; ++i) {
+                    ArgType arg_type = site->arg_types[i];
+                    const bool field = is_field(arg_type);
+                    if (field) {
+                        append_inline_string(decode_arg<const char*>(payload));
+                        arg_type = field_value_type(arg_type);
+                    }
+
+                    if (arg_type == ArgType::CStr) {
+                        append_inline_string(decode_arg<const char*>(payload));
+                    } else if (arg_type == ArgType::Custom) {
+                        // Only the backend knows the type
+                        const CustomValue value = decode_custom(payload);
+                        _custom_text.clear();
+                        if (field || text.custom_fields.empty() || text.custom_fields[arg_id] < 0) {
+                            value.codec->format(_custom_text, value.data, value.size, {});
+                        } else {
+                            render_custom(text.parsed.segments[text.custom_fields[arg_id]]);
+                        }
+                        append_inline_string(fmt::string_view(_custom_text.data(), _custom_text.size()));
+                    } else {
+                        const char* begin = payload;
+                        const size_t size = arg_type == ArgType::StlString
+                                                ? sizeof(uint32_t) + decode_arg<uint32_t>(payload)
+                                                : fixed_arg_size(arg_type);
+                        _args.append(begin, begin + size);
+                        payload = begin + size;
+                    }
+                    arg_id += field ? 0 : 1;
+                }
+
+                out.push_back(static_cast<char>(BinaryTag::Record));
+                append_varint(out, it->second.id);
+                out.push_back(static_cast<char>(level));
+                if (batch_begin) {
+                    _first_delta_begin = out.size();
+                    append_varint(out, zigzag_encode(wall_ns - _last_wall_ns));
+                    _first_delta_end = out.size();
+                    _first_wall_ns = wall_ns;
+                } else {
+                    append_varint(out, zigzag_encode(wall_ns - _last_wall_ns));
+                }
+                append_varint(out, _args.size());
+                out.append(_args.data(), _args.data() + _args.size());
+
+                _last_wall_ns = wall_ns;
+            }
+
+        private:
+            // By id, to write the definitions again when a batch is restarted
+            struct DefinitionText {
+                const CallSite* site;
+                std::string fmt_str;
+                // Parsed only with user type arguments, viewing fmt_str
+                ParsedFormat parsed;
+                // Per argument, the first segment which takes it, or -1. Empty without user type
+                // arguments, or if the format string is printed as it is.
+                std::vector<int> custom_fields;
+            };
+
+            inline uint64_t define(fmt::memory_buffer& out, const CallSite* site,
+                                   const char* fmt_str) {
+                const uint64_t id = static_cast<uint64_t>(_texts.size());
+                _texts.push_back(DefinitionText{site, fmt_str, ParsedFormat{{}, -1, false}, {}});
+                find_custom_fields(_texts.back());
+                append_definition(out, id, site, fmt_str);
+                return id;
+            }
+
+            // A user type argument is stored as its text with the spec of the first field which
+            // takes it. Without a field, or if the format string is printed as it is, the
+            // default spec is used.
+            static inline void find_custom_fields(DefinitionText& text) {
+                int arg_num = 0;
+                bool custom = false;
+                for (uint8_t i = 0; i < text.site->arg_num; ++i) {
+                    if (!is_field(text.site->arg_types[i])) {
+                        custom = custom || text.site->arg_types[i] == ArgType::Custom;
+                        ++arg_num;
+                    }
+                }
+                if (!custom) {
+                    return;
+                }
+
+                text.parsed = parse_format(text.fmt_str);
+                if (!text.parsed.valid || text.parsed.max_arg_id >= arg_num) {
+                    return;
+                }
+                text.custom_fields.assign(static_cast<size_t>(arg_num), -1);
+                for (size_t i = text.parsed.segments.size(); i-- > 0;) {
+                    const int field_arg_id = text.parsed.segments[i].arg_id;
+                    if (field_arg_id >= 0) {
+                        text.custom_fields[static_cast<size_t>(field_arg_id)] = static_cast<int>(i);
+                    }
+                }
+            }
+
+            // The arguments without the kv() fields, for the nested fields of a spec
+            inline void collect_values(const CallSite* site, const char* payload) {
+                ArgValueCollector collector{_values, 0};
+                ArgValue field_value;
+                for (uint8_t i = 0; i < site->arg_num; ++i) {
+                    const ArgType arg_type = site->arg_types[i];
+                    if (is_field(arg_type)) {
+                        decode_arg<const char*>(payload);
+                        ArgValueCollector value_collector{&field_value, 0};
+                        payload = visit_arg(field_value_type(arg_type), payload, value_collector);
+                    } else {
+                        payload = visit_arg(arg_type, payload, collector);
+                    }
+                }
+            }
+
+            // As render_format() does for the field
+            inline void render_custom(const FormatSegment& segment) {
+#if FMT_EXCEPTIONS
+                try {
+                    render_field(_custom_text, segment, _values);
+                } catch (const std::exception&) {
+                    _custom_text.clear();
+                    append(_custom_text, segment.field);
+                }
+#else
+                render_field(_custom_text, segment, _values);
+#endif
+            }
+
+            static inline void append_definition(fmt::memory_buffer& out, uint64_t id,
+                                                 const CallSite* site, const char* fmt_str) {
+                out.push_back(static_cast<char>(BinaryTag::Definition));
+                append_varint(out, id);
+                out.push_back(static_cast<char>(site->arg_num));
+                for (uint8_t i = 0; i < site->arg_num; ++i) {
+                    out.push_back(static_cast<char>(site->arg_types[i]));
+                }
+                const size_t fmt_size = std::strlen(fmt_str);
+                append_varint(out, fmt_size);
+                out.append(fmt_str, fmt_str + fmt_size);
+            }
+
+            inline void append_inline_string(fmt::string_view str) {
+                const uint32_t length = static_cast<uint32_t>(str.size());
+                _args.append(reinterpret_cast<const char*>(&length),
+                             reinterpret_cast<const char*>(&length) + sizeof(uint32_t));
+                _args.append(str.data(), str.data() + length);
+            }
+
+            // Format strings are identified by address, as they have to outlive the record anyway.
+            // One passed at run time may be gone and its address reused, so unless it is a
+            // literal it is compared too, like in FormatCache.
+            struct DefinitionKey {
+                const char* fmt_str;
+                const CallSite* site;
+
+                bool operator==(const DefinitionKey& other) const {
+                    return fmt_str == other.fmt_str && site == other.site;
+                }
+            };
+
+            struct DefinitionKeyHash {
+                size_t operator()(const DefinitionKey& key) const {
+                    return std::hash<const void*>()(key.fmt_str) * 31 +
+                           std::hash<const void*>()(key.site);
+                }
+            };
+
+            struct Definition {
+                uint64_t id;
+                // From the call site or in read-only memory, so never compared
+                bool literal;
+            };
+
+            std::unordered_map<DefinitionKey, Definition, DefinitionKeyHash> _definitions;
+            // A deque keeps each fmt_str in place for its parsed views
+            std::deque<DefinitionText> _texts;
+            fmt::memory_buffer _args;
+            fmt::memory_buffer _custom_text;
+            ArgValue _values[256];
+            TimePrecision _precision;
+            bool _header_written;
+            int64_t _last_wall_ns;
+            // The batch being encoded, the output buffer since it was last empty
+            size_t _batch_definition_num;
+            bool _batch_self_contained;
+            size_t _first_delta_begin;
+            size_t _first_delta_end;
+            int64_t _first_wall_ns;
+        };
+
+        class LogBuffer;
+
+    } // namespace detail
+
+    // Destination of formatted records. write() is called from the backend threads with whole
+    // records, one call at a time: loggers sharing the sink may be drained on different
+    // threads, so their writes are serialized by the sink. The level and format may be changed
+    // from any thread and apply from the next backend drain.
+    class Sink {
+    public:
+        Sink(LogLevel level, bool colored)
+            : _level(level), _format(OutputFormat::Text), _colored(colored) {}
+
+        virtual ~Sink() {}
+
+        Sink(const Sink& other) = delete;
+        Sink& operator=(const Sink& other) = delete;
+
+        virtual void write(const char* data, size_t size) = 0;
+
+        // File descriptor the crash handler writes the remaining records to as text, bypassing
+        // write(). -1 if there is none.
+        virtual int crash_fd() const { return -1; }
+
+        // Records below the level are skipped by this sink only
+        inline void set_level(LogLevel level) { _level.store(level, std::memory_order_relaxed); }
+
+        inline LogLevel get_level() const { return _level.load(std::memory_order_relaxed); }
+
+        // A format set here is kept. Until then the sink takes the output format of the
+        // loggers it is added to.
+        inline void set_format(OutputFormat format) {
+            _own_format.store(true, std::memory_order_relaxed);
+            _format.store(format, std::memory_order_relaxed);
+        }
+
+        inline void set_default_format(OutputFormat format) {
+            if (!_own_format.load(std::memory_order_relaxed)) {
+                _format.store(format, std::memory_order_relaxed);
+            }
+        }
+
+        inline OutputFormat get_format() const { return _format.load(std::memory_order_relaxed); }
+
+        // Text output with ANSI colors
+        inline bool colored() const { return _colored; }
+
+    protected:
+        // Called from write() when the sink started a new file, which needs the binary header
+        // again
+        inline void begin_new_output() { ++_output_num; }
+
+    private:
+        friend class detail::LogBuffer;
+
+        std::atomic<LogLevel> _level;
+        std::atomic<OutputFormat> _format;
+        std::atomic<bool> _own_format{false};
+        const bool _colored;
+        // Held around write(). The rest is guarded by it.
+        std::mutex _write_mutex;
+        // Binary output is continued only by the logger which wrote last, within an output
+        const void* _last_writer = nullptr;
+        uint64_t _output_num = 0;
+    };
+
+    // Writes to a FILE*, colored for stdout and stderr
+    class FileSink : public Sink {
+    public:
+        explicit FileSink(std::FILE* file, LogLevel level = LogLevel::Trace)
+            : Sink(level, file == stdout || file == stderr),
+              _file(file),
+              _fd(detail::file_descriptor(file)),
+              _owned(false) {}
+
+        // Opens the path for appending and closes it on destruction
+        explicit FileSink(const char* path, LogLevel level = LogLevel::Trace)
+            : Sink(level, false),
+              _file(std::fopen(path, "a")),
+              _fd(detail::file_descriptor(_file)),
+              _owned(true) {}
+
+        ~FileSink() override {
+            if (_owned && _file) {
+                std::fclose(_file);
+            }
+        }
+
+        inline bool is_open() const { return _file != nullptr; }
+
+        void write(const char* data, size_t size) override {
+            if (_file) {
+                detail::write_file(_file, data, size);
+            }
+        }
+
+        int crash_fd() const override { return _fd; }
+
+    private:
+        std::FILE* _file;
+        const int _fd;
+        const bool _owned;
+    };
+
+    // Keeps the latest capacity bytes of output in memory
+    class MemorySink : public Sink {
+    public:
+        explicit MemorySink(size_t capacity, LogLevel level = LogLevel::Trace)
+            : Sink(level, false), _buffer(capacity), _begin(0), _size(0) {}
+
+        void write(const char* data, size_t size) override {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            const size_t capacity = _buffer.size();
+            if (capacity == 0) {
+                return;
+            }
+            if (size > capacity) {
+                data += size - capacity;
+                size = capacity;
+            }
+
+            const size_t pos = (_begin + _size) % capacity;
+            const size_t first = size < capacity - pos ? size : capacity - pos;
+            std::memcpy(&_buffer[pos], data, first);
+            std::memcpy(&_buffer[0], data + first, size - first);
+
+            _size += size;
+            if (_size > capacity) {
+                _begin = (_begin + _size - capacity) % capacity;
+                _size = capacity;
+            }
+        }
+
+        // Oldest first. The oldest record may be cut at the front.
+        std::string contents() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+
+            std::string result;
+            result.reserve(_size);
+            const size_t first = _size < _buffer.size() - _begin ? _size : _buffer.size() - _begin;
+            result.append(_buffer.data() + _begin, first);
+            result.append(_buffer.data(), _size - first);
+            return result;
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _begin = 0;
+            _size = 0;
+        }
+
+    private:
+        mutable std::mutex _mutex;
+        std::vector<char> _buffer;
+        size_t _begin;
+        size_t _size;
+    };
+
+#if defined(__unix__) || defined(__APPLE__)
+    struct RotatingFileConfig {
+        // Active file. Rotated files get .1, .2, ... appended, .1 being the newest.
+        std::string path;
+        // Rotates once the file reaches this size, checked after each batch. 0 disables.
+        size_t max_file_size = 64 << 20;
+        // Rotates when the wall clock crosses a multiple of the interval, checked after each
+        // batch. 0 disables.
+        std::chrono::seconds rotation_interval{0};
+        // Rotated files kept besides the active one
+        size_t max_files = 5;
+        // Bytes mapped at once. Rounded up to the page size.
+        size_t segment_size = 4 << 20;
+    };
+
+    namespace detail {
+        // Runs tasks in order on its own thread
+        class TaskThread {
+        public:
+            TaskThread() : _run(true), _thread([this]() { run(); }) {}
+
+            ~TaskThread() { stop(); }
+
+            TaskThread(const TaskThread& other) = delete;
+            TaskThread& operator=(const TaskThread& other) = delete;
+
+            // Returns after the posted tasks are done
+            void stop() {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _run = false;
+                }
+                _cv.notify_one();
+                if (_thread.joinable()) {
+                    _thread.join();
+                }
+            }
+
+            void post(std::function<void()> task) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _tasks.push_back(std::move(task));
+                }
+                _cv.notify_one();
+            }
+
+        private:
+            // Finishes the posted tasks before exiting
+            void run() {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        _cv.wait(lock, [this]() { return !_tasks.empty() || !_run; });
+                        if (_tasks.empty()) {
+                            return;
+                        }
+                        task = std::move(_tasks.front());
+                        _tasks.pop_front();
+                    }
+                    task();
+                }
+            }
+
+            std::mutex _mutex;
+            std::condition_variable _cv;
+            std::deque<std::function<void()>> _tasks;
+            bool _run;
+            std::thread _thread;
+        };
+
+        struct MappedSegment {
+            char* data;
+            size_t offset;
+            size_t size;
+        };
+
+        // Log file written through mapped segments. The next segment is mapped in advance.
+        struct MappedFile {
+            int fd;
+            // Bytes written
+            size_t size;
+            MappedSegment current;
+            MappedSegment next;
+            bool next_ready;
+        };
+
+        // Allocates the file up to offset + size and maps the range, prefaulted where supported
+        inline bool map_segment(int fd, size_t offset, size_t size, MappedSegment& segment) {
+#if defined(__linux__)
+            if (posix_fallocate(fd, static_cast<off_t>(offset), static_cast<off_t>(size)) != 0) {
+                return false;
+            }
+#else
+            struct stat st;
+            if (fstat(fd, &st) != 0 ||
+                (static_cast<size_t>(st.st_size) < offset + size &&
+                 ftruncate(fd, static_cast<off_t>(offset + size)) != 0)) {
+                return false;
+            }
+#endif
+            int flags = MAP_SHARED;
+#if defined(MAP_POPULATE)
+            flags |= MAP_POPULATE;
+#endif
+            void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, fd,
+                              static_cast<off_t>(offset));
+            if (data == MAP_FAILED) {
+                return false;
+            }
+
+            segment = MappedSegment{static_cast<char*>(data), offset, size};
+            return true;
+        }
+
+        inline void unmap_segment(MappedSegment& segment) {
+            if (segment.data != nullptr) {
+                munmap(segment.data, segment.size);
+                segment.data = nullptr;
+            }
+        }
+
+        // Cuts the preallocated tail
+        inline void close_mapped_file(MappedFile& file) {
+            unmap_segment(file.current);
+            unmap_segment(file.next);
+            if (ftruncate(file.fd, static_cast<off_t>(file.size)) != 0) {
+                // The file keeps its zero filled tail
+            }
+            close(file.fd);
+        }
+
+        // Opens for appending after the existing content. Returns nullptr on failure.
+        inline std::unique_ptr<MappedFile> open_mapped_file(const std::string& path,
+                                                            size_t segment_size) {
+            const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) {
+                return nullptr;
+            }
+
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                close(fd);
+                return nullptr;
+            }
+
+            std::unique_ptr<MappedFile> file{new MappedFile{
+                fd, static_cast<size_t>(st.st_size), {nullptr, 0, 0}, {nullptr, 0, 0}, false}};
+
+            const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            const size_t offset = file->size / page_size * page_size;
+            if (!map_segment(fd, offset, segment_size, file->current)) {
+                close(fd);
+                return nullptr;
+            }
+            if (!map_segment(fd, offset + segment_size, segment_size, file->next)) {
+                file->size = static_cast<size_t>(st.st_size);
+                close_mapped_file(*file);
+                return nullptr;
+            }
+            file->next_ready = true;
+            return file;
+        }
+
+    } // namespace detail
+
+    // Writes into preallocated memory mapped segments and rotates by size and wall clock
+    // interval. Mapping the next segment, preparing the next file, closing and renaming
+    // happen on a helper thread, so the backend only copies bytes in the steady state.
+    // The next file is prepared as <path>.next. A file which was not closed cleanly
+    // keeps a zero filled tail.
+    class RotatingFileSink : public Sink {
+    public:
+        explicit RotatingFileSink(const RotatingFileConfig& config, LogLevel level = LogLevel::Trace)
+            : Sink(level, false),
+              _config(config),
+              _next_path(config.path + ".next"),
+              _deadline(0),
+              _failed(false),
+              _next_file_ready(false),
+              _next_file_failed(false) {
+            const size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            const size_t segment_size = _config.segment_size < page_size ? page_size
+                                                                         : _config.segment_size;
+            _config.segment_size = (segment_size + page_size - 1) / page_size * page_size;
+
+            _file = detail::open_mapped_file(_config.path, _config.segment_size);
+            if (!_file) {
+                return;
+            }
+
+            update_deadline();
+            _worker.post([this]() { prepare_next_file(); });
+        }
+
+        ~RotatingFileSink() override {
+            _worker.stop();
+
+            if (_file) {
+                detail::close_mapped_file(*_file);
+            }
+            if (_next_file) {
+                detail::close_mapped_file(*_next_file);
+                unlink(_next_path.c_str());
+            }
+        }
+
+        inline bool is_open() const { return _file != nullptr; }
+
+        // The crash handler appends to the current file with write(2), after the bytes copied
+        // into the mapping. The file offset is moved there once, as each logger sharing the
+        // sink asks for it.
+        int crash_fd() const override {
+            if (!_file) {
+                return -1;
+            }
+            if (!_crash_positioned.exchange(true, std::memory_order_relaxed)) {
+                lseek(_file->fd, static_cast<off_t>(_file->size), SEEK_SET);
+            }
+            return _file->fd;
+        }
+
+        void write(const char* data, size_t size) override {
+            if (!_file || _failed.load(std::memory_order_relaxed)) {
+                return;
+            }
+
+            while (size > 0) {
+                detail::MappedSegment& segment = _file->current;
+                const size_t pos = _file->size - segment.offset;
+                if (pos == segment.size) {
+                    if (!next_segment()) {
+                        return;
+                    }
+                    continue;
+                }
+
+                const size_t copy_size = size < segment.size - pos ? size : segment.size - pos;
+                std::memcpy(segment.data + pos, data, copy_size);
+                _file->size += copy_size;
+                data += copy_size;
+                size -= copy_size;
+            }
+
+            // Rotation happens between batches, so records are never split across files
+            if ((_config.max_file_size != 0 && _file->size >= _config.max_file_size) ||
+                (_deadline != 0 && detail::wall_now_ns() / 1000000000 >= _deadline)) {
+                rotate();
+            }
+        }
+
+    private:
+        inline void update_deadline() {
+            const int64_t interval = _config.rotation_interval.count();
+            if (interval > 0) {
+                _deadline = (detail::wall_now_ns() / 1000000000 / interval + 1) * interval;
+            }
+        }
+
+        // Switches to the segment mapped in advance. Waits only if the helper falls behind.
+        bool next_segment() {
+            detail::MappedFile* file = _file.get();
+            detail::MappedSegment old_segment;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _ready_cv.wait(lock, [&]() {
+                    return file->next_ready || _failed.load(std::memory_order_relaxed);
+                });
+                if (!file->next_ready) {
+                    return false;
+                }
+                old_segment = file->current;
+                file->current = file->next;
+                file->next_ready = false;
+            }
+
+            const size_t next_offset = file->current.offset + file->current.size;
+            _worker.post([this, file, old_segment, next_offset]() mutable {
+                detail::unmap_segment(old_segment);
+
+                detail::MappedSegment segment;
+                const bool mapped =
+                    detail::map_segment(file->fd, next_offset, _config.segment_size, segment);
+
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (mapped) {
+                    file->next = segment;
+                    file->next_ready = true;
+                } else {
+                    _failed.store(true, std::memory_order_relaxed);
+                }
+                _ready_cv.notify_one();
+            });
+            return true;
+        }
+
+        void rotate() {
+            std::unique_ptr<detail::MappedFile> next_file;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _ready_cv.wait(lock, [this]() {
+                    return _next_file_ready || _next_file_failed ||
+                           _failed.load(std::memory_order_relaxed);
+                });
+                if (_next_file_failed) {
+                    // The current file is still fine. It takes the output until the next
+                    // rotation point, where the next file is tried again.
+                    _next_file_failed = false;
+                } else if (!_next_file_ready) {
+                    return;
+                } else {
+                    next_file = std::move(_next_file);
+                    _next_file_ready = false;
+                }
+            }
+            if (!next_file) {
+                update_deadline();
+                _worker.post([this]() { prepare_next_file(); });
+                return;
+            }
+
+            detail::MappedFile* old_file = _file.release();
+            _file = std::move(next_file);
+            update_deadline();
+            begin_new_output();
+
+            // Tasks for a file run before the one closing it, so its next segment is settled
+            _worker.post([this, old_file]() {
+                detail::close_mapped_file(*old_file);
+                delete old_file;
+
+                shift_files();
+                prepare_next_file();
+            });
+        }
+
+        // <path>.(n-1) -> <path>.n ... <path> -> <path>.1, then <path>.next -> <path>
+        void shift_files() {
+            const std::string& path = _config.path;
+            if (_config.max_files == 0) {
+                unlink(path.c_str());
+            } else {
+                for (size_t i = _config.max_files - 1; i > 0; --i) {
+                    rename((path + "." + std::to_string(i)).c_str(),
+                           (path + "." + std::to_string(i + 1)).c_str());
+                }
+                rename(path.c_str(), (path + ".1").c_str());
+            }
+            rename(_next_path.c_str(), path.c_str());
+        }
+
+        void prepare_next_file() {
+            // A leftover from an unclean exit
+            unlink(_next_path.c_str());
+            std::unique_ptr<detail::MappedFile> file =
+                detail::open_mapped_file(_next_path, _config.segment_size);
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (file) {
+                _next_file = std::move(file);
+                _next_file_ready = true;
+            } else {
+                _next_file_failed = true;
+            }
+            _ready_cv.notify_one();
+        }
+
+        RotatingFileConfig _config;
+        const std::string _next_path;
+        // Written by the backend only
+        std::unique_ptr<detail::MappedFile> _file;
+        int64_t _deadline;
+        mutable std::atomic<bool> _crash_positioned{false};
+        // Shared with the helper thread. _failed is set when the current file cannot grow.
+        std::mutex _mutex;
+        std::condition_variable _ready_cv;
+        std::atomic<bool> _failed;
+        std::unique_ptr<detail::MappedFile> _next_file;
+        bool _next_file_ready;
+        bool _next_file_failed;
+        // Declared last, so the helper thread starts after everything it uses
+        detail::TaskThread _worker;
+    };
+#endif
+
+    namespace detail {
+
+        // Rings of exited threads kept for the next flight recorder dump
+        constexpr size_t max_retired_recorder_num = 64;
+
+        // Threads running the tasks of a batch along with the calling thread. run() is called
+        // by one backend thread at a time.
+        class FormatPool {
+        public:
+            FormatPool()
+                : _thread_num(1),
+                  _task(nullptr),
+                  _task_num(0),
+                  _generation(0),
+                  _remaining(0),
+                  _run(true) {}
+
+            ~FormatPool() {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _run = false;
+                }
+                _start_cv.notify_all();
+                for (auto& thread : _threads) {
+                    thread.join();
+                }
+            }
+
+            FormatPool(const FormatPool& other) = delete;
+            FormatPool& operator=(const FormatPool& other) = delete;
+
+            // Including the calling thread. Threads are started as needed and kept.
+            inline void set_thread_num(size_t thread_num) {
+                thread_num = thread_num < 1 ? 1 : thread_num;
+                while (_threads.size() + 1 < thread_num) {
+                    const size_t index = _threads.size() + 1;
+                    _threads.emplace_back([this, index]() { work(index); });
+                }
+                _thread_num = thread_num;
+            }
+
+            inline size_t thread_num() const { return _thread_num; }
+
+            // Calls task(i) for each i below task_num, which is at most thread_num(). task(0)
+            // runs on the calling thread. Returns once every call has returned.
+            inline void run(size_t task_num, const std::function<void(size_t)>& task) {
+                {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _task = &task;
+                    _task_num = task_num;
+                    _remaining = task_num - 1;
+                    ++_generation;
+                }
+                if (task_num > 1) {
+                    _start_cv.notify_all();
+                }
+
+                task(0);
+
+                std::unique_lock<std::mutex> lock(_mutex);
+                _done_cv.wait(lock, [this]() { return _remaining == 0; });
+                _task = nullptr;
+            }
+
+        private:
+            void work(size_t index) {
+                uint64_t generation = 0;
+                while (true) {
+                    const std::function<void(size_t)>* task;
+                    {
+                        std::unique_lock<std::mutex> lock(_mutex);
+                        _start_cv.wait(lock, [&]() { return _generation != generation || !_run; });
+                        if (!_run) {
+                            return;
+                        }
+                        generation = _generation;
+                        if (index >= _task_num) {
+                            continue;
+                        }
+                        task = _task;
+                    }
+
+                    (*task)(index);
+
+                    bool done;
+                    {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        done = --_remaining == 0;
+                    }
+                    if (done) {
+                        _done_cv.notify_one();
+                    }
+                }
+            }
+
+            size_t _thread_num;
+            std::vector<std::thread> _threads;
+            std::mutex _mutex;
+            std::condition_variable _start_cv;
+            std::condition_variable _done_cv;
+            const std::function<void(size_t)>* _task;
+            size_t _task_num;
+            uint64_t _generation;
+            size_t _remaining;
+            bool _run;
+        };
+
+        // Records per format thread below which a batch is not split further
+        constexpr size_t min_format_chunk = 32;
+
+        // Set by the crash handler. The backend threads stop at their next turn and leave the
+        // queues to it.
+        inline std::atomic<bool>& crash_requested() {
+            static std::atomic<bool> requested{false};
+            return requested;
+        }
+
+        // Longest wait of the crash handler for a backend thread to stop
+        constexpr std::chrono::milliseconds crash_stop_timeout{500};
+
+        // BackendWorker of the calling thread, nullptr on other threads
+        inline const void*& current_backend() {
+            static thread_local const void* backend = nullptr;
+            return backend;
+        }
+
+        // A record of the crash handler, rendered as text without allocating or locking and
+        // cut at the capacity. Format specs are ignored, and custom arguments are printed as
+        // their size, as their formatters may allocate.
+        class CrashLine {
+        public:
+            static constexpr size_t capacity = 4096;
+
+            CrashLine() : _size(0) {}
+
+            inline void clear() { _size = 0; }
+
+            inline const char* data() const { return _data; }
+
+            inline size_t size() const { return _size; }
+
+            inline void append(const char* data, size_t size) {
+                const size_t copy_size = size < capacity - _size ? size : capacity - _size;
+                std::memcpy(_data + _size, data, copy_size);
+                _size += copy_size;
+            }
+
+            inline void append(fmt::string_view str) { append(str.data(), str.size()); }
+
+            template <typename T>
+            inline void append_value(const T& value) {
+                const auto result = fmt::format_to_n(_data + _size, capacity - _size, "{}", value);
+                _size += result.size < capacity - _size ? result.size : capacity - _size;
+            }
+
+            // Seconds since the epoch, as the calendar time would need the time zone
+            inline void append_time(int64_t wall_ns) {
+                const int64_t ns_in_sec = 1000000000;
+                int64_t sec = wall_ns / ns_in_sec;
+                int64_t sub_ns = wall_ns % ns_in_sec;
+                if (sub_ns < 0) {
+                    sec -= 1;
+                    sub_ns += ns_in_sec;
+                }
+                const auto result =
+                    fmt::format_to_n(_data + _size, capacity - _size, "{}.{:09} ", sec, sub_ns);
+                _size += result.size < capacity - _size ? result.size : capacity - _size;
+            }
+
+            // The message, then the fields as key=value
+            void append_message(const char* fmt_str, uint8_t arg_num, const ArgType* arg_types,
+                                const char* payload) {
+                ArgValueCollector collector{_args, 0};
+                size_t field_num = 0;
+                for (uint8_t i = 0; i < arg_num; ++i) {
+                    const ArgType arg_type = arg_types[i];
+                    if (is_field(arg_type)) {
+                        FieldValue& field = _fields[field_num++];
+                        field.key = decode_arg<const char*>(payload);
+                        ArgValueCollector value_collector{&field.value, 0};
+                        payload = visit_arg(field_value_type(arg_type), payload, value_collector);
+                    } else {
+                        payload = visit_arg(arg_type, payload, collector);
+                    }
+                }
+
+                append_format(fmt_str, collector.size);
+                for (size_t i = 0; i < field_num; ++i) {
+                    append(" ", 1);
+                    append(_fields[i].key);
+                    append("=", 1);
+                    append_arg(_fields[i].value);
+                }
+            }
+
+        private:
+            // Each replacement field takes its argument id or the next argument. The nested
+            // fields of a spec take one more each.
+            void append_format(const char* fmt_str, size_t arg_num) {
+                size_t next_id = 0;
+                const char* p = fmt_str;
+                while (*p != '\0') {
+                    if (*p != '{' || p[1] == '{') {
+                        // An escaped brace is written once
+                        if ((*p == '{' || *p == '}') && p[1] == *p) {
+                            ++p;
+                        }
+                        append(p, 1);
+                        ++p;
+                        continue;
+                    }
+
+                    ++p;
+                    size_t id = next_id;
+                    if (*p >= '0' && *p <= '9') {
+                        id = 0;
+                        while (*p >= '0' && *p <= '9') {
+                            id = id * 10 + static_cast<size_t>(*p++ - '0');
+                        }
+                    } else {
+                        ++next_id;
+                    }
+
+                    int depth = 1;
+                    while (*p != '\0' && depth > 0) {
+                        if (*p == '{') {
+                            next_id += p[1] == '}' ? 1 : 0;
+                            ++depth;
+                        } else if (*p == '}') {
+                            --depth;
+                        }
+                        ++p;
+                    }
+
+                    if (id < arg_num) {
+                        append_arg(_args[id]);
+                    }
+                }
+            }
+
+            void append_arg(const ArgValue& arg) {
+                switch (arg.kind) {
+                case ArgValue::Kind::Int:
+                    append_value(arg.int_value);
+                    break;
+                case ArgValue::Kind::UInt:
+                    append_value(arg.uint_value);
+                    break;
+                case ArgValue::Kind::LongLong:
+                    append_value(arg.long_long_value);
+                    break;
+                case ArgValue::Kind::ULongLong:
+                    append_value(arg.ulong_long_value);
+                    break;
+                case ArgValue::Kind::Bool:
+                    append_value(arg.bool_value);
+                    break;
+                case ArgValue::Kind::Char:
+                    append(&arg.char_value, 1);
+                    break;
+                case ArgValue::Kind::Float:
+                    append_value(arg.float_value);
+                    break;
+                case ArgValue::Kind::Double:
+                    append_value(arg.double_value);
+                    break;
+                case ArgValue::Kind::LongDouble:
+                    append_value(arg.long_double_value);
+                    break;
+                case ArgValue::Kind::CStr:
+                case ArgValue::Kind::String:
+                    append(arg_value_string(arg));
+                    break;
+                case ArgValue::Kind::Pointer:
+                    append_value(arg.pointer_value);
+                    break;
+                case ArgValue::Kind::Custom:
+                    append("<", 1);
+                    append_value(arg.custom_value.size);
+                    append(" bytes>");
+                    break;
+                }
+            }
+
+            char _data[capacity];
+            size_t _size;
+            ArgValue _args[256];
+            FieldValue _fields[256];
+        };
+
+        constexpr size_t CrashLine::capacity;
+
+        // Made by the installation of the crash handler, so that it is not constructed in it
+        inline CrashLine& crash_line() {
+            static CrashLine line;
+            return line;
+        }
+
+        class LogBuffer {
+        public:
+            explicit LogBuffer()
+                : _id(next_id()),
+                  _wakeup(&_own_wakeup),
+                  _current(nullptr),
+                  _dropped_count(0),
+                  _unreported_dropped(0),
+                  _reclaimed(),
+                  _batch_size(0),
+                  _unflushed_num(0),
+                  _unflushed_base(0),
+                  _unflushed_delta_sum(0),
+                  _unflushed_min(0),
+                  _batch_num(0),
+                  _batch_record_num(0),
+                  _max_batch_size(0),
+                  _written(0),
+                  _latency_sum_ns(0),
+                  _max_latency_ns(0),
+                  _format_ns(0),
+                  _write_ns(0),
+                  _sink_list{std::make_shared<FileSink>(stdout)},
+                  _sinks_changed(true) {}
+
+            LogBuffer(const LogBuffer& other) = delete;
+            LogBuffer& operator=(const LogBuffer& other) = delete;
+
+            LogBuffer(LogBuffer&& other) noexcept = delete;
+            LogBuffer& operator=(LogBuffer&& other) noexcept = delete;
+
+            // Wait-free except for the first call on each thread, which registers its queue.
+            // A record which does not fit in the queue is dropped as a whole.
+            template <typename... Args>
+            inline void enqueue(LogLevel level, const char* fmt_str,
+                                const Args&... args) {
+                enqueue_record(level, &ArgSignature<Args...>::call_site, fmt_str, args...);
+            }
+
+            template <typename... Args>
+            inline void enqueue(const CallSite* site, const Args&... args) {
+                enqueue_record(site->level, site, site->fmt_str, args...);
+            }
+
+            // Takes over newly registered queues, reclaims drained queues of exited threads
+            // and fixes the set of records to be dequeued until the next snapshot.
+            inline void snapshot() {
+                apply_sinks();
+                finish_batch();
+
+                {
+                    std::lock_guard<std::mutex> lock(_registry_mutex);
+                    _stats_period = _config.stats_period;
+                    _suppressed_period = _config.suppressed_period;
+                    _log_thread = _config.log_thread;
+                    _rate_limiters.insert(_rate_limiters.end(), _new_rate_limiters.begin(),
+                                          _new_rate_limiters.end());
+                    _new_rate_limiters.clear();
+                    _new_queues.take([&](std::shared_ptr<LogQueue> queue) {
+                        if (_scratch.size() < queue->capacity()) {
+                            _scratch.resize(queue->capacity());
+                        }
+                        _unreported_memory_failed += queue->memory_failed() ? 1 : 0;
+                        _queues.push_back(QueueCursor{std::move(queue), 0, 0});
+                    });
+
+                    _flight_recorder_trigger = _config.flight_recorder_trigger;
+                    _new_recorders.take([&](std::shared_ptr<LogQueue> recorder) {
+                        if (_recorder_scratch.size() < recorder->capacity()) {
+                            _recorder_scratch.resize(recorder->capacity());
+                        }
+                        _unreported_memory_failed += recorder->memory_failed() ? 1 : 0;
+                        _recorders.push_back(QueueCursor{std::move(recorder), 0, 0});
+                    });
+                }
+                release_retired_recorders(max_retired_recorder_num);
+
+                if (_log_thread) {
+                    ThreadRegistry& registry = ThreadRegistry::instance();
+                    const uint64_t version = registry.version();
+                    if (version != _thread_names_version) {
+                        _thread_names = registry.names();
+                        _thread_names_version = version;
+                    }
+                }
+
+                size_t i = 0;
+                while (i < _queues.size()) {
+                    auto& cursor = _queues[i];
+                    const bool retired = cursor.queue->retired();
+                    cursor.end = cursor.queue->tail();
+                    // The producer may move the head past the tail read above
+                    const size_t head = cursor.queue->head();
+                    cursor.queue->sample_high_water(cursor.end > head ? cursor.end - head : 0);
+
+                    const uint64_t dropped = cursor.queue->dropped();
+                    if (dropped != cursor.dropped) {
+                        _unreported_dropped += dropped - cursor.dropped;
+                        _dropped_count.fetch_add(dropped - cursor.dropped, std::memory_order_relaxed);
+                        cursor.dropped = dropped;
+                    }
+
+                    if (retired && cursor.queue->head() >= cursor.end) {
+                        reclaim(*cursor.queue);
+                        cursor = std::move(_queues.back());
+                        _queues.pop_back();
+                    } else {
+                        ++i;
+                    }
+                }
+
+                build_heap();
+            }
+
+            void dequeue() {
+                const char* record = front();
+                if (record != nullptr) {
+                    if (!_recorders.empty() && record_header(record).level >= _flight_recorder_trigger) {
+                        dump_recorders(record_header(record).time_stamp, false);
+                    }
+                    print_record(record, false);
+                    count_printed(record_header(record).time_stamp);
+                    pop_front();
+                }
+                select_next();
+                flush_output_if_full();
+            }
+
+            // Should be called once per drain to follow the wall clock
+            inline void calibrate_time() { _calibrator.calibrate(); }
+
+            void dequeue_with_time() {
+                const char* record = front();
+                if (record != nullptr) {
+                    if (!_recorders.empty() && record_header(record).level >= _flight_recorder_trigger) {
+                        dump_recorders(record_header(record).time_stamp, true);
+                    }
+                    print_record(record, true);
+                    count_printed(record_header(record).time_stamp);
+                    pop_front();
+                }
+                select_next();
+                flush_output_if_full();
+            }
+
+            // Prints the number of records dropped since the last report, if any
+            void report_dropped() { report_dropped(false); }
+
+            void report_dropped_with_time() { report_dropped(true); }
+
+            inline uint64_t dropped_count() const {
+                return _dropped_count.load(std::memory_order_relaxed);
+            }
+
+            inline void set_config(const LoggerConfig& config) {
+                std::lock_guard<std::mutex> lock(_registry_mutex);
+                _config = config;
+                _flight_recorder_level.store(config.flight_recorder_level, std::memory_order_relaxed);
+                _flush_level.store(config.flush_level, std::memory_order_relaxed);
+                _flush_timeout_ms.store(config.flush_timeout.count(), std::memory_order_relaxed);
+            }
+
+            inline LoggerConfig get_config() {
+                std::lock_guard<std::mutex> lock(_registry_mutex);
+                return _config;
+            }
+
+            // Registered by the first suppression at a rate limited call site
+            inline void add_rate_limiter(RateLimiter* limiter) {
+                std::lock_guard<std::mutex> lock(_registry_mutex);
+                _new_rate_limiters.push_back(limiter);
+            }
+
+            // Safe to call from any thread. The backend counters are as of its last drain.
+            inline LoggerStats stats() {
+                LoggerStats stats = LoggerStats();
+                {
+                    std::lock_guard<std::mutex> lock(_registry_mutex);
+                    add_queue_stats(stats, _reclaimed);
+                    for (const auto& queue : _all_queues) {
+                        const QueueStats queue_stats = queue->stats();
+                        add_queue_stats(stats, queue_stats);
+                        stats.queues.push_back(queue_stats);
+                    }
+                }
+
+                stats.batch_num = _batch_num.load(std::memory_order_relaxed);
+                stats.batch_record_num = _batch_record_num.load(std::memory_order_relaxed);
+                stats.max_batch_size = _max_batch_size.load(std::memory_order_relaxed);
+                stats.written = _written.load(std::memory_order_relaxed);
+                stats.latency_sum_ns = _latency_sum_ns.load(std::memory_order_relaxed);
+                stats.max_latency_ns = _max_latency_ns.load(std::memory_order_relaxed);
+                stats.format_ns = _format_ns.load(std::memory_order_relaxed);
+                stats.write_ns = _write_ns.load(std::memory_order_relaxed);
+                return stats;
+            }
+
+            inline bool empty() { return _current == nullptr; }
+
+            // Sleeps the backend until the period passes or a producer wakes it
+            inline void wait_for_wakeup(std::chrono::microseconds period) { _wakeup->wait_for(period); }
+
+            inline void wakeup() { _wakeup->notify(); }
+
+            // Producers wake the given backend instead. Has to be set before the first record.
+            inline void set_wakeup(WakeupSignal& wakeup) { _wakeup = &wakeup; }
+
+            // drain() splits the formatting across the threads of the pool. Has to be set
+            // before the first cycle.
+            inline void set_format_pool(FormatPool& format_pool) { _format_pool = &format_pool; }
+
+            // One backend cycle is begin_cycle(), drain() until it returns false, then
+            // flush_output()
+            inline void begin_cycle(bool with_time) {
+                if (with_time) {
+                    calibrate_time();
+                }
+                // Requests made before the snapshot are done once it is written
+                const uint64_t flush_request = _flush_requested.load(std::memory_order_acquire);
+                snapshot();
+                _flush_covered = flush_request;
+                report_dropped(with_time);
+                report_memory_failed(with_time);
+                report_suppressed(with_time);
+                report_stats(with_time);
+
+                // Dumped once the records logged before the request are printed
+                if (_dump_requested.load(std::memory_order_relaxed) &&
+                    _dump_requested.exchange(false, std::memory_order_acquire)) {
+                    _dump_pending = true;
+                    _dump_time_stamp = now_ticks();
+                }
+            }
+
+            // Prints up to max_record_num records of the snapshot. Returns false once it is drained.
+            inline bool drain(size_t max_record_num, bool with_time) {
+                const uint64_t write_ns = _write_ns.load(std::memory_order_relaxed);
+                const auto start = std::chrono::steady_clock::now();
+
+                if (_format_pool != nullptr && _format_pool->thread_num() > 1) {
+                    // A turn for each format thread
+                    const size_t collect_num = max_record_num * _format_pool->thread_num();
+                    for (size_t i = 0; i < collect_num && !empty(); ++i) {
+                        collect(with_time);
+                    }
+                    render_collected(with_time);
+                } else {
+                    for (size_t i = 0; i < max_record_num && !empty(); ++i) {
+                        if (with_time) {
+                            dequeue_with_time();
+                        } else {
+                            dequeue();
+                        }
+                    }
+                }
+
+                // Sinks may be written in between when their batch is full
+                const uint64_t elapsed_ns = elapsed_ns_since(start);
+                const uint64_t drain_write_ns = _write_ns.load(std::memory_order_relaxed) - write_ns;
+                add_relaxed(_format_ns, elapsed_ns > drain_write_ns ? elapsed_ns - drain_write_ns : 0);
+
+                if (_dump_pending && empty()) {
+                    dump_recorders(_dump_time_stamp, with_time);
+                    _dump_pending = false;
+                }
+
+                return !empty();
+            }
+
+            // Writes the batch of each sink with one write call
+            inline void flush_output() {
+                for (auto& slot : _sinks) {
+                    flush_sink(slot);
+                }
+                count_flushed();
+                if (empty()) {
+                    complete_flush();
+                }
+            }
+
+            // Waits until the records enqueued before the call are written to the sinks, for at
+            // most timeout. Returns false on timeout, and right away on a backend thread.
+            inline bool flush(std::chrono::milliseconds timeout) {
+                if (current_backend() != nullptr) {
+                    return false;
+                }
+
+                const uint64_t request = _flush_requested.fetch_add(1, std::memory_order_acq_rel) + 1;
+                _wakeup->notify();
+
+                std::unique_lock<std::mutex> lock(_flush_mutex);
+                return _flush_cv.wait_for(lock, timeout, [&]() {
+                    return _flush_done.load(std::memory_order_acquire) >= request;
+                });
+            }
+
+            // Sink changes take effect on the next snapshot()
+
+            inline void add_sink(std::shared_ptr<Sink> sink) {
+                std::lock_guard<std::mutex> lock(_sink_mutex);
+                sink->set_default_format(_output_format);
+                _sink_list.push_back(std::move(sink));
+                _sinks_changed.store(true, std::memory_order_release);
+            }
+
+            inline void remove_sink(const std::shared_ptr<Sink>& sink) {
+                std::lock_guard<std::mutex> lock(_sink_mutex);
+                for (size_t i = 0; i < _sink_list.size(); ++i) {
+                    if (_sink_list[i] == sink) {
+                        _sink_list.erase(_sink_list.begin() + i);
+                        break;
+                    }
+                }
+                _sinks_changed.store(true, std::memory_order_release);
+            }
+
+            // Replaces every sink
+            inline void set_sink(std::shared_ptr<Sink> sink) {
+                std::lock_guard<std::mutex> lock(_sink_mutex);
+                sink->set_default_format(_output_format);
+                _sink_list.clear();
+                _sink_list.push_back(std::move(sink));
+                _sinks_changed.store(true, std::memory_order_release);
+            }
+
+            inline void set_output_file(FILE* output_file) {
+                set_sink(std::make_shared<FileSink>(output_file));
+            }
+
+            // Applies to the current sinks and the ones added later, except those with a format
+            // set by Sink::set_format()
+            inline void set_output_format(OutputFormat output_format) {
+                std::lock_guard<std::mutex> lock(_sink_mutex);
+                _output_format = output_format;
+                for (auto& sink : _sink_list) {
+                    sink->set_default_format(output_format);
+                }
+            }
+
+            inline OutputFormat get_output_format() {
+                std::lock_guard<std::mutex> lock(_sink_mutex);
+                return _output_format;
+            }
+
+            inline void set_log_level(LogLevel log_level) {
+                _log_level.store(log_level, std::memory_order_relaxed);
+            }
+
+            inline LogLevel get_log_level() { return _log_level.load(std::memory_order_relaxed); }
+
+            // Whether a record of the level is printed or goes to the flight recorder
+            inline bool accepts(LogLevel level) const {
+                return level >= _log_level.load(std::memory_order_relaxed) ||
+                       level < _flight_recorder_level.load(std::memory_order_relaxed);
+            }
+
+            // Makes the queues of the calling thread, so that its first record does not pay for them
+            inline void prepare_thread() {
+                local_queue();
+                if (_flight_recorder_level.load(std::memory_order_relaxed) > LogLevel::Trace) {
+                    local_recorder();
+                }
+            }
+
+            // Makes the backend print every flight recorder on its next cycle
+            inline void dump_flight_recorder() {
+                _dump_requested.store(true, std::memory_order_release);
+                _wakeup->notify();
+            }
+
+#if defined(__unix__) || defined(__APPLE__)
+            // Writes the records left in the flight recorders, then in the queues, to the text
+            // sinks with a crash_fd(), or to stderr if there is none. Does not allocate or lock,
+            // for the crash handler once the backend thread has stopped. Queues made since the
+            // last snapshot are merged in from the list they are published on.
+            void crash_drain() {
+                CrashTarget target;
+                for (auto& slot : _sinks) {
+                    const int fd = slot->sink->crash_fd();
+                    if (fd >= 0 && slot->format == OutputFormat::Text &&
+                        target.fd_num < CrashTarget::max_fd_num) {
+                        target.fds[target.fd_num] = fd;
+                        target.levels[target.fd_num] = slot->level;
+                        ++target.fd_num;
+                    }
+                }
+                if (target.fd_num == 0) {
+                    target.fds[0] = STDERR_FILENO;
+                    target.levels[0] = LogLevel::Trace;
+                    target.fd_num = 1;
+                }
+
+                crash_drain(_recorders, _new_recorders, _recorder_scratch, target);
+                crash_drain(_queues, _new_queues, _scratch, target);
+            }
+#endif
+
+            inline void set_time_precision(TimePrecision precision) {
+                _render.time_stamp_cache.set_precision(precision);
+            }
+
+            inline TimePrecision get_time_precision() const {
+                return _render.time_stamp_cache.get_precision();
+            }
+
+        private:
+            struct QueueCursor {
+                std::shared_ptr<LogQueue> queue;
+                size_t end;
+                uint64_t dropped;
+            };
+
+            // Queues registered by producers until a snapshot takes them over. Changed under the
+            // registry lock, and published so that the crash handler can walk them without it.
+            class NewQueues {
+            public:
+                struct Node {
+                    std::shared_ptr<LogQueue> queue;
+                    Node* next;
+                    // Tail of the queue when the crash handler started on it
+                    size_t crash_end;
+                };
+
+                NewQueues() : _last(nullptr) {}
+
+                ~NewQueues() {
+                    take([](std::shared_ptr<LogQueue>) {});
+                }
+
+                NewQueues(const NewQueues& other) = delete;
+                NewQueues& operator=(const NewQueues& other) = delete;
+
+                inline void push(std::shared_ptr<LogQueue> queue) {
+                    Node* node = new Node{std::move(queue), _last.load(std::memory_order_relaxed), 0};
+                    _last.store(node, std::memory_order_release);
+                }
+
+                // Newest first
+                inline Node* last() const { return _last.load(std::memory_order_acquire); }
+
+                // Passes each queue to f, oldest first, and empties the list
+                template <typename F>
+                inline void take(F f) {
+                    Node* node = _last.exchange(nullptr, std::memory_order_acq_rel);
+                    Node* first = nullptr;
+                    while (node != nullptr) {
+                        Node* const next = node->next;
+                        node->next = first;
+                        first = node;
+                        node = next;
+                    }
+
+                    while (first != nullptr) {
+                        Node* const next = first->next;
+                        f(std::move(first->queue));
+                        delete first;
+                        first = next;
+                    }
+                }
+
+            private:
+                std::atomic<Node*> _last;
+            };
+
+            // Queues of the producer thread, one per LogBuffer it logs to and one per flight
+            // recorder, retired on thread exit. The queue of a destroyed LogBuffer is kept until
+            // then, as ids are not reused.
+            struct LocalQueues {
+                struct Entry {
+                    uint64_t buffer_id;
+                    bool recorder;
+                    std::shared_ptr<LogQueue> queue;
+                };
+
+                std::vector<Entry> entries;
+                // Most threads log to one logger
+                uint64_t last_buffer_id = 0;
+                LogQueue* last_queue = nullptr;
+                uint64_t last_recorder_buffer_id = 0;
+                LogQueue* last_recorder = nullptr;
+
+                ~LocalQueues() {
+                    for (auto& entry : entries) {
+                        entry.queue->retire();
+                    }
+                }
+            };
+
+            static inline uint64_t next_id() {
+                static std::atomic<uint64_t> id{0};
+                return ++id;
+            }
+
+            // One reservation and one commit per record
+            template <typename... Args>
+            inline void enqueue_record(LogLevel level, const CallSite* site, const char* fmt_str,
+                                       const Args&... args) {
+                LogQueue& queue = level < _flight_recorder_level.load(std::memory_order_relaxed)
+                                      ? local_recorder()
+                                      : local_queue();
+
+                const size_t size = record_size(site, args...);
+                char* record = queue.reserve(size);
+                if (record == nullptr) {
+                    queue.count_dropped(level);
+                    return;
+                }
+
+                const RecordHeader header{
+                    static_cast<uint32_t>(size),
+                    level,
+                    queue.thread_index(),
+                    now_ticks(),
+                    site,
+                };
+                std::memcpy(record, &header, sizeof(RecordHeader));
+
+                char* dst = record + sizeof(RecordHeader);
+                if (site->fmt_str == nullptr) {
+                    std::memcpy(dst, &fmt_str, sizeof(const char*));
+                    dst += sizeof(const char*);
+                }
+
+                // Braced initialization guarantees left-to-right order
+                const int dummy[] = {0, (dst = encode_arg(dst, args), 0)...};
+                (void)dummy;
+
+                queue.commit();
+                queue.count_enqueued(level);
+
+                if (level >= _flush_level.load(std::memory_order_relaxed)) {
+                    flush(std::chrono::milliseconds(_flush_timeout_ms.load(std::memory_order_relaxed)));
+                }
+            }
+
+            // Batch of formatted records for one sink, with its settings read once per drain
+            struct SinkSlot {
+                std::shared_ptr<Sink> sink;
+                fmt::memory_buffer batch;
+                LogLevel level;
+                OutputFormat format;
+                bool colored;
+                BinaryEncoder binary_encoder;
+                // Output of the sink the last batch went to
+                uint64_t output_num = 0;
+            };
+
+#if defined(__unix__) || defined(__APPLE__)
+            struct CrashTarget {
+                static constexpr size_t max_fd_num = 8;
+
+                int fds[max_fd_num];
+                LogLevel levels[max_fd_num];
+                size_t fd_num = 0;
+            };
+
+            // Oldest record first, up to the tail of each queue at the call
+            void crash_drain(std::vector<QueueCursor>& cursors, NewQueues& new_queues,
+                             std::vector<char>& scratch, const CrashTarget& target) {
+                for (auto& cursor : cursors) {
+                    cursor.end = cursor.queue->tail();
+                }
+                for (NewQueues::Node* node = new_queues.last(); node != nullptr; node = node->next) {
+                    node->crash_end = node->queue->tail();
+                }
+
+                while (true) {
+                    LogQueue* oldest = nullptr;
+                    size_t* oldest_end = nullptr;
+                    uint64_t min_time_stamp = 0;
+                    const auto visit = [&](LogQueue& queue, size_t& end) {
+                        if (queue.head() < end) {
+                            const uint64_t time_stamp = record_header(queue.front()).time_stamp;
+                            if (oldest == nullptr || time_stamp < min_time_stamp) {
+                                oldest = &queue;
+                                oldest_end = &end;
+                                min_time_stamp = time_stamp;
+                            }
+                        }
+                    };
+                    for (auto& cursor : cursors) {
+                        visit(*cursor.queue, cursor.end);
+                    }
+                    for (NewQueues::Node* node = new_queues.last(); node != nullptr; node = node->next) {
+                        visit(*node->queue, node->crash_end);
+                    }
+                    if (oldest == nullptr) {
+                        break;
+                    }
+
+                    if (!oldest->overwrite()) {
+                        write_crash_record(oldest->front(), target);
+                        oldest->pop_front();
+                    } else if (scratch.size() < oldest->capacity()) {
+                        // A new queue larger than the scratch sized at the last snapshot
+                        *oldest_end = 0;
+                    } else {
+                        const char* record = oldest->claim_front(scratch.data(), *oldest_end);
+                        if (record != nullptr) {
+                            write_crash_record(record, target);
+                        }
+                    }
+                }
+            }
+
+            // Time stamp, level, thread and message, as printed without color
+            void write_crash_record(const char* record, const CrashTarget& target) {
+                const RecordHeader header = record_header(record);
+                const char* payload = record + sizeof(RecordHeader);
+                const char* fmt_str = header.site->fmt_str;
+                if (fmt_str == nullptr) {
+                    fmt_str = decode_arg<const char*>(payload);
+                }
+
+                CrashLine& line = crash_line();
+                line.clear();
+                line.append_time(_calibrator.to_wall_ns(header.time_stamp));
+                line.append(_style.plain_level[static_cast<int>(header.level)]);
+                if (_log_thread && header.thread_index != 0) {
+                    // The names of threads started since the last snapshot are not copied yet
+                    const fmt::string_view name =
+                        ThreadRegistry::instance().crash_name(header.thread_index);
+                    line.append("[", 1);
+                    if (name.size() != 0) {
+                        line.append(name);
+                    } else {
+                        line.append_value(header.thread_index);
+                    }
+                    line.append("] ", 2);
+                }
+                line.append_message(fmt_str, header.site->arg_num, header.site->arg_types, payload);
+                line.append("\n", 1);
+
+                for (size_t i = 0; i < target.fd_num; ++i) {
+                    if (header.level >= target.levels[i]) {
+                        write_fd(target.fds[i], line.data(), line.size());
+                    }
+                }
+            }
+#endif
+
+            // Decoding and formatting state of one format thread
+            struct RenderState {
+                FormatCache format_cache;
+                TimeStampCache time_stamp_cache;
+                // Text and JSON output per sink of a chunk
+                std::vector<fmt::memory_buffer> batches;
+            };
+
+            // Picks up sink changes, keeping the batch and encoder of the remaining sinks
+            inline void apply_sinks() {
+                if (_sinks_changed.load(std::memory_order_acquire)) {
+                    flush_output();
+                    rebuild_sinks();
+                }
+
+                for (auto& slot : _sinks) {
+                    slot->level = slot->sink->get_level();
+                    const OutputFormat format = slot->sink->get_format();
+                    if (format != slot->format) {
+                        flush_sink(slot);
+                        slot->format = format;
+                        slot->binary_encoder.reset();
+                    }
+                }
+            }
+
+            inline void rebuild_sinks() {
+                std::lock_guard<std::mutex> lock(_sink_mutex);
+                _sinks_changed.store(false, std::memory_order_relaxed);
+
+                std::vector<std::unique_ptr<SinkSlot>> sinks;
+                for (const auto& sink : _sink_list) {
+                    std::unique_ptr<SinkSlot> slot;
+                    for (auto& old_slot : _sinks) {
+                        if (old_slot && old_slot->sink == sink) {
+                            slot = std::move(old_slot);
+                            break;
+                        }
+                    }
+                    if (!slot) {
+                        slot.reset(new SinkSlot());
+                        slot->sink = sink;
+                        slot->format = sink->get_format();
+                        slot->colored = sink->colored();
+                    }
+                    sinks.push_back(std::move(slot));
+                }
+                _sinks = std::move(sinks);
+            }
+
+            inline void flush_sink(std::unique_ptr<SinkSlot>& slot) {
+                if (slot->batch.size() != 0) {
+                    const auto start = std::chrono::steady_clock::now();
+                    Sink& sink = *slot->sink;
+                    {
+                        std::lock_guard<std::mutex> lock(sink._write_mutex);
+                        // Taken before write() may begin a new file, which the next batch
+                        // then restarts in
+                        const uint64_t output_num = sink._output_num;
+                        const bool continued = sink._last_writer == slot.get() &&
+                                               sink._output_num == slot->output_num;
+                        if (slot->format == OutputFormat::Binary && !continued &&
+                            !slot->binary_encoder.batch_self_contained()) {
+                            // Another logger wrote in between, or a new file began
+                            _restart_batch.clear();
+                            slot->binary_encoder.restart(_restart_batch, slot->batch);
+                            sink.write(_restart_batch.data(), _restart_batch.size());
+                        } else {
+                            sink.write(slot->batch.data(), slot->batch.size());
+                        }
+                        slot->output_num = output_num;
+                        sink._last_writer = slot.get();
+                    }
+                    add_relaxed(_write_ns, elapsed_ns_since(start));
+                    slot->batch.clear();
+                }
+            }
+
+            inline void complete_flush() {
+                if (_flush_done.load(std::memory_order_relaxed) != _flush_covered) {
+                    _flush_done.store(_flush_covered, std::memory_order_release);
+                    // Orders the store with a thread which is about to wait
+                    { std::lock_guard<std::mutex> lock(_flush_mutex); }
+                    _flush_cv.notify_all();
+                }
+            }
+
+            inline void flush_output_if_full() {
+                for (auto& slot : _sinks) {
+                    if (slot->batch.size() >= EFP_LOG_OUTPUT_BUFFER_SIZE) {
+                        flush_sink(slot);
+                    }
+                }
+            }
+
+            // print_* functions append to the batches written by flush_output().
+            // A record is decoded once. The text body and the JSON line are each formatted into
+            // the first sink of their format and copied to the others.
+            inline void print_record(const char* record, bool with_time) {
+                print_record(record, with_time, _render, false);
+            }
+
+            // With to_state, the text and JSON output of sink i goes to state.batches[i] and
+            // binary sinks are left to encode_binary()
+            inline void print_record(const char* record, bool with_time, RenderState& state,
+                                     bool to_state) {
+                const RecordHeader header = record_header(record);
+
+                fmt::memory_buffer* body_batch = nullptr;
+                size_t body_begin = 0;
+                size_t body_size = 0;
+                fmt::memory_buffer* json_batch = nullptr;
+                size_t json_begin = 0;
+                size_t json_size = 0;
+                bool decoded = false;
+                fmt::string_view time_stamp;
+
+                for (size_t i = 0; i < _sinks.size(); ++i) {
+                    SinkSlot& slot = *_sinks[i];
+                    if (header.level < slot.level) {
+                        continue;
+                    }
+
+                    if (slot.format == OutputFormat::Binary) {
+                        if (!to_state) {
+                            encode_binary(slot, header, record);
+                        }
+                        continue;
+                    }
+
+                    fmt::memory_buffer& batch = to_state ? state.batches[i] : slot.batch;
+
+                    if (with_time && time_stamp.size() == 0) {
+                        time_stamp = state.time_stamp_cache.render(_calibrator.to_wall_ns(header.time_stamp));
+                    }
+
+                    if (!decoded) {
+                        decode_body(state.format_cache, header, record);
+                        decoded = true;
+                    }
+
+                    if (slot.format == OutputFormat::Json) {
+                        if (json_batch == nullptr) {
+                            json_batch = &batch;
+                            json_begin = batch.size();
+                            print_json(batch, state.format_cache, header, time_stamp);
+                            json_size = batch.size() - json_begin;
+                        } else {
+                            batch.append(json_batch->data() + json_begin,
+                                         json_batch->data() + json_begin + json_size);
+                        }
+                        continue;
+                    }
+
+                    if (with_time) {
+                        print_time_stamp(batch, time_stamp, slot.colored);
+                    }
+                    print_level(batch, header.level, slot.colored);
+                    if (_log_thread && header.thread_index != 0) {
+                        print_thread(batch, header.thread_index);
+                    }
+
+                    if (body_batch == nullptr) {
+                        body_batch = &batch;
+                        body_begin = batch.size();
+                        print_body(batch, state.format_cache);
+                        body_size = batch.size() - body_begin;
+                    } else {
+                        batch.append(body_batch->data() + body_begin,
+                                     body_batch->data() + body_begin + body_size);
+                    }
+                }
+            }
+
+            inline void encode_binary(SinkSlot& slot, const RecordHeader& header, const char* record) {
+                const char* payload = record + sizeof(RecordHeader);
+                const char* fmt_str = header.site->fmt_str;
+                if (fmt_str == nullptr) {
+                    fmt_str = decode_arg<const char*>(payload);
+                }
+
+                slot.binary_encoder.encode(slot.batch, _render.time_stamp_cache.get_precision(),
+                                           header.level, _calibrator.to_wall_ns(header.time_stamp),
+                                           fmt_str, header.site, payload);
+            }
+
+            // Copies the next record for the format threads. Binary sinks are encoded here,
+            // in order, and the others by render_collected().
+            inline void collect(bool with_time) {
+                const char* record = front();
+                if (record != nullptr) {
+                    const RecordHeader header = record_header(record);
+                    if (!_recorders.empty() && header.level >= _flight_recorder_trigger) {
+                        render_collected(with_time);
+                        dump_recorders(header.time_stamp, with_time);
+                    }
+
+                    for (auto& slot : _sinks) {
+                        if (slot->format == OutputFormat::Binary && header.level >= slot->level) {
+                            encode_binary(*slot, header, record);
+                        }
+                    }
+
+                    _collected_offsets.push_back(_collected.size());
+                    _collected.insert(_collected.end(), record, record + header.size);
+                    count_printed(header.time_stamp);
+                    pop_front();
+                }
+                select_next();
+            }
+
+            // Splits the collected records into contiguous chunks, one per format thread, and
+            // appends their output in order
+            void render_collected(bool with_time) {
+                const size_t record_num = _collected_offsets.size();
+                if (record_num == 0) {
+                    return;
+                }
+
+                const size_t chunk_num = (record_num + min_format_chunk - 1) / min_format_chunk;
+                _chunk_num = chunk_num < _format_pool->thread_num() ? chunk_num : _format_pool->thread_num();
+                _chunk_with_time = with_time;
+                while (_format_states.size() + 1 < _chunk_num) {
+                    _format_states.emplace_back(new RenderState());
+                }
+                for (size_t i = 0; i < _chunk_num; ++i) {
+                    RenderState& state = render_state(i);
+                    state.batches.resize(_sinks.size());
+                    state.time_stamp_cache.set_precision(_render.time_stamp_cache.get_precision());
+                }
+
+                _format_pool->run(_chunk_num, _render_chunk);
+
+                for (size_t i = 0; i < _chunk_num; ++i) {
+                    RenderState& state = render_state(i);
+                    for (size_t j = 0; j < _sinks.size(); ++j) {
+                        _sinks[j]->batch.append(state.batches[j].data(),
+                                                state.batches[j].data() + state.batches[j].size());
+                        state.batches[j].clear();
+                    }
+                }
+                _collected.clear();
+                _collected_offsets.clear();
+                flush_output_if_full();
+            }
+
+            inline void render_chunk(size_t chunk) {
+                RenderState& state = render_state(chunk);
+                const size_t record_num = _collected_offsets.size();
+                const size_t end = record_num * (chunk + 1) / _chunk_num;
+                for (size_t i = record_num * chunk / _chunk_num; i < end; ++i) {
+                    print_record(&_collected[_collected_offsets[i]], _chunk_with_time, state, true);
+                }
+            }
+
+            // The backend thread renders the first chunk with its own state
+            inline RenderState& render_state(size_t chunk) {
+                return chunk == 0 ? _render : *_format_states[chunk - 1];
+            }
+
+            // Reports go through the same path as a logged record. Fixed size arguments only.
+            template <typename... Args>
+            void print_report(const CallSite* site, bool with_time, const Args&... args) {
+                alignas(RecordHeader) char record[256];
+                const RecordHeader header{
+                    static_cast<uint32_t>(record_size(site, args...)),
+                    site->level,
+                    0,
+                    now_ticks(),
+                    site,
+                };
+                std::memcpy(record, &header, sizeof(RecordHeader));
+
+                char* dst = record + sizeof(RecordHeader);
+                const int dummy[] = {0, (dst = encode_arg(dst, args), 0)...};
+                (void)dummy;
+                (void)dst;
+
+                print_record(record, with_time);
+            }
+
+            void report_dropped(bool with_time) {
+                if (_unreported_dropped == 0) {
+                    return;
+                }
+
+                static const CallSite dropped_call_site{
+                    "efp logger dropped {} records on queue overflow",
+                    LogLevel::Warn,
+                    __FILE__,
+                    __LINE__,
+                    ArgSignature<uint64_t>::arg_num,
+                    ArgSignature<uint64_t>::types,
+                };
+
+                print_report(&dropped_call_site, with_time, _unreported_dropped);
+                _unreported_dropped = 0;
+            }
+
+            void report_memory_failed(bool with_time) {
+                if (_unreported_memory_failed == 0) {
+                    return;
+                }
+
+                static const CallSite memory_call_site{
+                    "efp logger can not lock or back with huge pages the memory of {} queues",
+                    LogLevel::Warn,
+                    __FILE__,
+                    __LINE__,
+                    ArgSignature<uint64_t>::arg_num,
+                    ArgSignature<uint64_t>::types,
+                };
+
+                print_report(&memory_call_site, with_time, _unreported_memory_failed);
+                _unreported_memory_failed = 0;
+            }
+
+            // Prints the recorded records up to the time stamp, oldest first across the threads
+            void dump_recorders(uint64_t max_time_stamp, bool with_time) {
+                using EndSignature = ArgSignature<uint64_t>;
+                static const CallSite begin_call_site{
+                    "efp logger flight recorder dump begins",
+                    LogLevel::Info,
+                    __FILE__,
+                    __LINE__,
+                    ArgSignature<>::arg_num,
+                    ArgSignature<>::types,
+                };
+                static const CallSite end_call_site{
+                    "efp logger flight recorder dump ends with {} records",
+                    LogLevel::Info,
+                    __FILE__,
+                    __LINE__,
+                    EndSignature::arg_num,
+                    EndSignature::types,
+                };
+
+                for (auto& cursor : _recorders) {
+                    cursor.end = cursor.queue->tail();
+                }
+
+                uint64_t record_num = 0;
+                while (true) {
+                    QueueCursor* oldest = nullptr;
+                    uint64_t min_time_stamp = 0;
+                    for (auto& cursor : _recorders) {
+                        if (cursor.queue->head() < cursor.end) {
+                            const uint64_t time_stamp = record_header(cursor.queue->front()).time_stamp;
+                            if (oldest == nullptr || time_stamp < min_time_stamp) {
+                                oldest = &cursor;
+                                min_time_stamp = time_stamp;
+                            }
+                        }
+                    }
+                    if (oldest == nullptr || min_time_stamp > max_time_stamp) {
+                        break;
+                    }
+
+                    // nullptr if the producer has overwritten the rest meanwhile
+                    const char* record = oldest->queue->claim_front(_recorder_scratch.data(), oldest->end);
+                    if (record != nullptr) {
+                        if (record_num == 0) {
+                            print_report(&begin_call_site, with_time);
+                        }
+                        print_record(record, with_time);
+                        ++record_num;
+                    }
+                }
+
+                if (record_num != 0) {
+                    print_report(&end_call_site, with_time, record_num);
+                }
+                release_retired_recorders(0);
+            }
+
+            // Releases the drained rings of exited threads beyond max_retired_num, oldest first.
+            // The others are kept for the next dump.
+            inline void release_retired_recorders(size_t max_retired_num) {
+                size_t retired_num = 0;
+                for (const auto& cursor : _recorders) {
+                    retired_num += cursor.queue->retired() ? 1 : 0;
+                }
+
+                size_t i = 0;
+                while (i < _recorders.size() && retired_num > max_retired_num) {
+                    const LogQueue& recorder = *_recorders[i].queue;
+                    if (recorder.retired() && (max_retired_num != 0 || recorder.head() >= recorder.tail())) {
+                        _recorders.erase(_recorders.begin() + i);
+                        --retired_num;
+                    } else {
+                        ++i;
+                    }
+                }
+            }
+
+            // Logs the records suppressed at each rate limited call site since the last report
+            void report_suppressed(bool with_time) {
+                if (_rate_limiters.empty()) {
+                    return;
+                }
+
+                const auto now = std::chrono::steady_clock::now();
+                if (_next_suppressed_report.time_since_epoch().count() == 0) {
+                    _next_suppressed_report = now + _suppressed_period;
+                    return;
+                }
+                if (now < _next_suppressed_report) {
+                    return;
+                }
+                _next_suppressed_report = now + _suppressed_period;
+
+                using Signature = ArgSignature<uint64_t, const char*, const char*, int>;
+                static const CallSite suppressed_call_site{
+                    "efp logger suppressed {} records of \"{}\" at {}:{}",
+                    LogLevel::Warn,
+                    __FILE__,
+                    __LINE__,
+                    Signature::arg_num,
+                    Signature::types,
+                };
+
+                for (RateLimiter* limiter : _rate_limiters) {
+                    const uint64_t suppressed = limiter->take_suppressed();
+                    if (suppressed != 0) {
+                        const CallSite* site = limiter->site();
+                        print_report(&suppressed_call_site, with_time, suppressed, site->fmt_str,
+                                     site->file, site->line);
+                    }
+                }
+            }
+
+            // Logs the stats every stats_period, if set
+            void report_stats(bool with_time) {
+                if (_stats_period.count() == 0) {
+                    return;
+                }
+
+                const auto now = std::chrono::steady_clock::now();
+                if (_next_stats_report.time_since_epoch().count() == 0) {
+                    _next_stats_report = now + _stats_period;
+                    return;
+                }
+                if (now < _next_stats_report) {
+                    return;
+                }
+                _next_stats_report = now + _stats_period;
+
+                using Signature = ArgSignature<uint64_t, uint64_t, uint64_t, uint64_t, double,
+                                               uint64_t, double, double, double, double>;
+                static const CallSite stats_call_site{
+                    "efp logger stats: {} enqueued, {} dropped, {} overwritten, "
+                    "queue high water {}%, {:.1f} records per batch and {} at most, "
+                    "latency {:.1f} us on average and {:.1f} us at most, "
+                    "{:.1f} ms formatting, {:.1f} ms writing",
+                    LogLevel::Info,
+                    __FILE__,
+                    __LINE__,
+                    Signature::arg_num,
+                    Signature::types,
+                };
+
+                const LoggerStats stats = this->stats();
+                uint64_t enqueued = 0;
+                uint64_t dropped = 0;
+                for (size_t i = 0; i < log_level_num; ++i) {
+                    enqueued += stats.enqueued[i];
+                    dropped += stats.dropped[i];
+                }
+                uint64_t high_water_percent = 0;
+                for (const QueueStats& queue : stats.queues) {
+                    const uint64_t percent = queue.high_water * 100 / queue.capacity;
+                    high_water_percent = percent > high_water_percent ? percent : high_water_percent;
+                }
+
+                print_report(&stats_call_site, with_time, enqueued, dropped, stats.overwritten,
+                             high_water_percent,
+                             stats.batch_num == 0 ? 0.0 : static_cast<double>(stats.batch_record_num) / stats.batch_num,
+                             stats.max_batch_size,
+                             stats.written == 0 ? 0.0 : stats.latency_sum_ns / 1e3 / stats.written,
+                             stats.max_latency_ns / 1e3, stats.format_ns / 1e6, stats.write_ns / 1e6);
+            }
+
+            static inline uint64_t elapsed_ns_since(std::chrono::steady_clock::time_point start) {
+                return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                 std::chrono::steady_clock::now() - start)
+                                                 .count());
+            }
+
+            static inline void add_queue_stats(LoggerStats& stats, const QueueStats& queue_stats) {
+                for (size_t i = 0; i < log_level_num; ++i) {
+                    stats.enqueued[i] += queue_stats.enqueued[i];
+                    stats.dropped[i] += queue_stats.dropped[i];
+                }
+                stats.overwritten += queue_stats.overwritten;
+            }
+
+            // Keeps the counters of a queue about to be released
+            inline void reclaim(const LogQueue& queue) {
+                std::lock_guard<std::mutex> lock(_registry_mutex);
+                const QueueStats queue_stats = queue.stats();
+                for (size_t i = 0; i < log_level_num; ++i) {
+                    _reclaimed.enqueued[i] += queue_stats.enqueued[i];
+                    _reclaimed.dropped[i] += queue_stats.dropped[i];
+                }
+                _reclaimed.overwritten += queue_stats.overwritten;
+
+                for (size_t i = 0; i < _all_queues.size(); ++i) {
+                    if (_all_queues[i].get() == &queue) {
+                        _all_queues[i] = std::move(_all_queues.back());
+                        _all_queues.pop_back();
+                        break;
+                    }
+                }
+            }
+
+            // The records of a snapshot make a batch
+            inline void finish_batch() {
+                if (_batch_size != 0) {
+                    add_relaxed(_batch_num, 1);
+                    add_relaxed(_batch_record_num, _batch_size);
+                    max_relaxed(_max_batch_size, _batch_size);
+                    _batch_size = 0;
+                }
+            }
+
+            // Time stamps are summed as deltas to the first one, which can not overflow
+            inline void count_printed(uint64_t time_stamp) {
+                if (_unflushed_num == 0) {
+                    _unflushed_base = time_stamp;
+                    _unflushed_min = time_stamp;
+                }
+                _unflushed_delta_sum += static_cast<int64_t>(time_stamp - _unflushed_base);
+                _unflushed_min = time_stamp < _unflushed_min ? time_stamp : _unflushed_min;
+                ++_unflushed_num;
+                ++_batch_size;
+            }
+
+            inline void count_flushed() {
+                if (_unflushed_num == 0) {
+                    return;
+                }
+
+                const int64_t now_ns = _calibrator.to_wall_ns(now_ticks());
+                const uint64_t mean_time_stamp =
+                    _unflushed_base + static_cast<uint64_t>(_unflushed_delta_sum /
+                                                            static_cast<int64_t>(_unflushed_num));
+                const int64_t mean_ns = now_ns - _calibrator.to_wall_ns(mean_time_stamp);
+                const int64_t max_ns = now_ns - _calibrator.to_wall_ns(_unflushed_min);
+
+                add_relaxed(_written, _unflushed_num);
+                add_relaxed(_latency_sum_ns, mean_ns > 0 ? static_cast<uint64_t>(mean_ns) * _unflushed_num : 0);
+                max_relaxed(_max_latency_ns, max_ns > 0 ? static_cast<uint64_t>(max_ns) : 0);
+
+                _unflushed_num = 0;
+                _unflushed_delta_sum = 0;
+            }
+
+            inline void print_time_stamp(fmt::memory_buffer& out, fmt::string_view time_stamp,
+                                         bool colored) {
+                if (colored) {
+                    append(out, _style.time_begin);
+                    append(out, time_stamp);
+                    out.push_back(' ');
+                    append(out, OutputStyle::reset);
+                } else {
+                    append(out, time_stamp);
+                    out.push_back(' ');
+                }
+            }
+
+            inline void print_level(fmt::memory_buffer& out, LogLevel level, bool colored) {
+                if (colored) {
+                    append(out, _style.colored_level[static_cast<int>(level)]);
+                } else {
+                    append(out, _style.plain_level[static_cast<int>(level)]);
+                }
+            }
+
+            inline void decode_body(FormatCache& format_cache, const RecordHeader& header,
+                                    const char* record) {
+                const CallSite* site = header.site;
+                const char* payload = record + sizeof(RecordHeader);
+
+                const char* fmt_str = site->fmt_str;
+                if (fmt_str == nullptr) {
+                    fmt_str = decode_arg<const char*>(payload);
+                }
+
+                format_cache.decode(fmt_str, site->fmt_str != nullptr, site->arg_num,
+                                    site->arg_types, payload);
+            }
+
+            // The message, then the fields as key=value
+            inline void print_body(fmt::memory_buffer& out, FormatCache& format_cache) {
+                format_cache.render_text(out);
+                out.push_back('\n');
+            }
+
+            // {"time":...,"level":...,"message":...,<fields>}, without time if it is empty
+            // [name] or [number]
+            inline void print_thread(fmt::memory_buffer& out, uint16_t thread_index) {
+                out.push_back('[');
+                if (thread_index < _thread_names.size() && !_thread_names[thread_index].empty()) {
+                    append(out, _thread_names[thread_index]);
+                } else {
+                    fmt::format_to(fmt::appender(out), "{}", thread_index);
+                }
+                append(out, "] ");
+            }
+
+            inline void print_json(fmt::memory_buffer& out, FormatCache& format_cache,
+                                   const RecordHeader& header, fmt::string_view time_stamp) {
+                // Neither the time stamp nor the level needs escaping
+                if (time_stamp.size() != 0) {
+                    append(out, "{\"time\":\"");
+                    append(out, time_stamp);
+                    append(out, "\",");
+                } else {
+                    out.push_back('{');
+                }
+                append(out, _style.json_level[static_cast<int>(header.level)]);
+
+                const uint16_t thread_index = header.thread_index;
+                if (_log_thread && thread_index != 0) {
+                    append(out, "\"thread\":");
+                    if (thread_index < _thread_names.size() && !_thread_names[thread_index].empty()) {
+                        append_json_string(out, _thread_names[thread_index]);
+                    } else {
+                        fmt::format_to(fmt::appender(out), "{}", thread_index);
+                    }
+                    out.push_back(',');
+                }
+
+                format_cache.render_json(out);
+                append(out, "}\n");
+            }
+
+            static inline LocalQueues& local_queues() {
+                static thread_local LocalQueues local{};
+                return local;
+            }
+
+            inline LogQueue& local_queue() {
+                LocalQueues& local = local_queues();
+                if (local.last_buffer_id != _id) {
+                    local.last_queue = find_or_register(local, false);
+                    local.last_buffer_id = _id;
+                }
+                return *local.last_queue;
+            }
+
+            inline LogQueue& local_recorder() {
+                LocalQueues& local = local_queues();
+                if (local.last_recorder_buffer_id != _id) {
+                    local.last_recorder = find_or_register(local, true);
+                    local.last_recorder_buffer_id = _id;
+                }
+                return *local.last_recorder;
+            }
+
+            inline LogQueue* find_or_register(LocalQueues& local, bool recorder) {
+                for (auto& entry : local.entries) {
+                    if (entry.buffer_id == _id && entry.recorder == recorder) {
+                        return entry.queue.get();
+                    }
+                }
+
+                std::lock_guard<std::mutex> lock(_registry_mutex);
+                std::shared_ptr<LogQueue> queue;
+                if (recorder) {
+                    // Keeps the last records without waking the backend
+                    LoggerConfig recorder_config = _config;
+                    recorder_config.queue_capacity = _config.flight_recorder_capacity;
+                    recorder_config.overflow_policy = OverflowPolicy::OverwriteOldest;
+                    recorder_config.wakeup_fill_percent = 0;
+                    queue = std::make_shared<LogQueue>(recorder_config, *_wakeup);
+                    _new_recorders.push(queue);
+                } else {
+                    queue = std::make_shared<LogQueue>(_config, *_wakeup);
+                    _new_queues.push(queue);
+                    _all_queues.push_back(queue);
+                }
+                local.entries.push_back(LocalQueues::Entry{_id, recorder, queue});
+                return queue.get();
+            }
+
+            // Record at the head of the current queue, nullptr if it has been overwritten
+            inline const char* front() {
+                return _current->queue->overwrite()
+                           ? _current->queue->claim_front(_scratch.data(), _current->end)
+                           : _current->queue->front();
+            }
+
+            inline void pop_front() {
+                if (!_current->queue->overwrite()) {
+                    _current->queue->pop_front();
+                }
+            }
+
+            // Queue in the heap of the snapshot, by the time stamp of its oldest record, then
+            // by its position in _queues
+            struct HeapEntry {
+                uint64_t time_stamp;
+                size_t index;
+            };
+
+            // Orders the heap with the oldest record on top
+            static inline bool later(const HeapEntry& lhs, const HeapEntry& rhs) {
+                return lhs.time_stamp != rhs.time_stamp ? lhs.time_stamp > rhs.time_stamp
+                                                        : lhs.index > rhs.index;
+            }
+
+            // Puts every queue with records within the snapshot in the heap
+            inline void build_heap() {
+                _heap.clear();
+                for (size_t i = 0; i < _queues.size(); ++i) {
+                    const QueueCursor& cursor = _queues[i];
+                    if (cursor.queue->head() < cursor.end) {
+                        _heap.push_back(HeapEntry{record_header(cursor.queue->front()).time_stamp, i});
+                    }
+                }
+                std::make_heap(_heap.begin(), _heap.end(), later);
+                select_top();
+            }
+
+            // Moves the top queue to its next record, or out of the heap once it is drained
+            // within the snapshot. Then picks the queue holding the oldest record.
+            inline void select_next() {
+                if (!_heap.empty()) {
+                    update_top();
+                }
+                select_top();
+            }
+
+            inline void update_top() {
+                std::pop_heap(_heap.begin(), _heap.end(), later);
+                HeapEntry& entry = _heap.back();
+                const QueueCursor& cursor = _queues[entry.index];
+                if (cursor.queue->head() < cursor.end) {
+                    entry.time_stamp = record_header(cursor.queue->front()).time_stamp;
+                    std::push_heap(_heap.begin(), _heap.end(), later);
+                } else {
+                    _heap.pop_back();
+                }
+            }
+
+            // The producer of an overwriting queue may have moved its head since the time
+            // stamp was read, to a later record, so the top is read again until it holds
+            inline void select_top() {
+                while (!_heap.empty()) {
+                    const HeapEntry& top = _heap.front();
+                    const QueueCursor& cursor = _queues[top.index];
+                    if (!cursor.queue->overwrite() ||
+                        (cursor.queue->head() < cursor.end &&
+                         record_header(cursor.queue->front()).time_stamp == top.time_stamp)) {
+                        break;
+                    }
+                    update_top();
+                }
+                _current = _heap.empty() ? nullptr : &_queues[_heap.front().index];
+            }
+
+            const uint64_t _id;
+            WakeupSignal _own_wakeup;
+            WakeupSignal* _wakeup;
+            std::mutex _registry_mutex;
+            NewQueues _new_queues;
+            std::vector<QueueCursor> _queues;
+            std::vector<HeapEntry> _heap;
+            QueueCursor* _current;
+            std::vector<char> _scratch;
+            LoggerConfig _config;
+            std::atomic<uint64_t> _dropped_count;
+            uint64_t _unreported_dropped;
+            uint64_t _unreported_memory_failed = 0;
+            // Queues not yet reclaimed and the counters of the reclaimed ones, for stats()
+            std::vector<std::shared_ptr<LogQueue>> _all_queues;
+            QueueStats _reclaimed;
+            // Backend counters. Only the backend writes, stats() reads.
+            std::chrono::seconds _stats_period{0};
+            std::chrono::steady_clock::time_point _next_stats_report;
+            // Rate limited call sites, registered by producers and taken over at a snapshot
+            std::vector<RateLimiter*> _new_rate_limiters;
+            std::vector<RateLimiter*> _rate_limiters;
+            std::chrono::seconds _suppressed_period{1};
+            std::chrono::steady_clock::time_point _next_suppressed_report;
+            // Flight recorders, registered by producers and taken over at a snapshot. The level is
+            // read by producers while set_config may change it.
+            std::atomic<LogLevel> _flight_recorder_level{LogLevel::Trace};
+            LogLevel _flight_recorder_trigger = LogLevel::Error;
+            NewQueues _new_recorders;
+            std::vector<QueueCursor> _recorders;
+            std::vector<char> _recorder_scratch;
+            std::atomic<bool> _dump_requested{false};
+            // Names of the threads as of the last snapshot, by thread index
+            bool _log_thread = false;
+            std::vector<std::string> _thread_names;
+            uint64_t _thread_names_version = 0;
+            bool _dump_pending = false;
+            uint64_t _dump_time_stamp = 0;
+            // Flush requests, done once the snapshot after them is written. The level and the
+            // timeout are read by producers while set_config may change them.
+            std::atomic<LogLevel> _flush_level{LogLevel::Off};
+            std::atomic<std::chrono::milliseconds::rep> _flush_timeout_ms{100};
+            std::atomic<uint64_t> _flush_requested{0};
+            std::atomic<uint64_t> _flush_done{0};
+            uint64_t _flush_covered = 0;
+            std::mutex _flush_mutex;
+            std::condition_variable _flush_cv;
+            uint64_t _batch_size;
+            uint64_t _unflushed_num;
+            uint64_t _unflushed_base;
+            int64_t _unflushed_delta_sum;
+            uint64_t _unflushed_min;
+            std::atomic<uint64_t> _batch_num;
+            std::atomic<uint64_t> _batch_record_num;
+            std::atomic<uint64_t> _max_batch_size;
+            std::atomic<uint64_t> _written;
+            std::atomic<uint64_t> _latency_sum_ns;
+            std::atomic<uint64_t> _max_latency_ns;
+            std::atomic<uint64_t> _format_ns;
+            std::atomic<uint64_t> _write_ns;
+            // State of the backend thread, which also renders the first chunk of a split batch
+            RenderState _render;
+            // Records copied for the format threads, split into chunks by render_collected()
+            FormatPool* _format_pool = nullptr;
+            std::vector<std::unique_ptr<RenderState>> _format_states;
+            std::vector<char> _collected;
+            std::vector<size_t> _collected_offsets;
+            size_t _chunk_num = 0;
+            bool _chunk_with_time = false;
+            const std::function<void(size_t)> _render_chunk{[this](size_t chunk) { render_chunk(chunk); }};
+            std::atomic<LogLevel> _log_level{LogLevel::Info};
+            // Sinks as set by the user, copied into _sinks by the backend
+            std::mutex _sink_mutex;
+            std::vector<std::shared_ptr<Sink>> _sink_list;
+            std::atomic<bool> _sinks_changed;
+            OutputFormat _output_format = OutputFormat::Text;
+            std::vector<std::unique_ptr<SinkSlot>> _sinks;
+            // A binary batch with the header and definitions put in front
+            fmt::memory_buffer _restart_batch;
+            OutputStyle _style;
+            TickCalibrator _calibrator;
+        };
+
+        // Records a logger prints per turn. The loggers of a backend thread take turns within
+        // each cycle, so a logger with a backlog does not hold back the others.
+        constexpr size_t drain_quota = 256;
+
+        // Backend thread of the pool, draining the LogBuffers assigned to it
+        class BackendWorker {
+        public:
+            // The backend settings are read from the config of config_source
+            BackendWorker(unsigned index, std::shared_ptr<LogBuffer> config_source)
+                : _index(index),
+                  _config_source(std::move(config_source)),
+                  _changed(false),
+                  _run(true),
+                  _thread([this]() { run(); }) {}
+
+            BackendWorker(const BackendWorker& other) = delete;
+            BackendWorker& operator=(const BackendWorker& other) = delete;
+
+            // Has to be called before the first record of the buffer
+            inline void add(std::shared_ptr<LogBuffer> buffer) {
+                buffer->set_wakeup(_wakeup);
+                buffer->set_format_pool(_format_pool);
+                std::lock_guard<std::mutex> lock(_mutex);
+                _buffers.push_back(std::move(buffer));
+                _changed.store(true, std::memory_order_release);
+            }
+
+            // The buffer is drained once more on the next cycle, then released
+            inline void remove(const LogBuffer* buffer) {
+                std::lock_guard<std::mutex> lock(_mutex);
+                for (size_t i = 0; i < _buffers.size(); ++i) {
+                    if (_buffers[i].get() == buffer) {
+                        _removed.push_back(std::move(_buffers[i]));
+                        _buffers.erase(_buffers.begin() + i);
+                        _changed.store(true, std::memory_order_release);
+                        _wakeup.notify();
+                        break;
+                    }
+                }
+            }
+
+            inline size_t size() {
+                std::lock_guard<std::mutex> lock(_mutex);
+                return _buffers.size();
+            }
+
+            // Joins the thread and drains what is left
+            inline void stop() {
+                _run.store(false);
+                _wakeup.notify();
+
+                if (_thread.joinable()) {
+                    _thread.join();
+                }
+
+                update_buffers();
+                cycle();
+                cycle();
+            }
+
+#if defined(__unix__) || defined(__APPLE__)
+            // From the crash handler. Stops the thread if it is sleeping, or waits until it
+            // stops at its next turn, up to the deadline. Then drains its buffers. The buffers of
+            // a thread still busy are left alone.
+            inline void crash_drain(std::chrono::steady_clock::time_point deadline) {
+                while (current_backend() != this) {
+                    int state = idle;
+                    if (_state.compare_exchange_strong(state, stopped, std::memory_order_acq_rel) ||
+                        state == stopped) {
+                        break;
+                    }
+                    if (std::chrono::steady_clock::now() >= deadline) {
+                        return;
+                    }
+                    const timespec interval{0, 100000};
+                    nanosleep(&interval, nullptr);
+                }
+
+                for (auto& buffer : _cycle_buffers) {
+                    buffer->crash_drain();
+                }
+            }
+#endif
+
+        private:
+            inline void run() {
+                current_backend() = this;
+                int backend_cpu = -1;
+                int backend_priority = 0;
+
+                while (_run.load()) {
+                    const LoggerConfig config = _config_source->get_config();
+                    place(config, backend_cpu, backend_priority);
+                    _format_pool.set_thread_num(config.format_threads);
+
+                    update_buffers();
+                    stop_on_crash();
+                    cycle();
+
+                    if (!config.busy_spin) {
+                        // Everything is written while asleep, so the crash handler may take over
+                        _state.store(idle, std::memory_order_release);
+                        _wakeup.wait_for(config.poll_period);
+                        int state = idle;
+                        if (!_state.compare_exchange_strong(state, running, std::memory_order_acq_rel)) {
+                            halt();
+                        }
+                    }
+                }
+            }
+
+            // Removed buffers stay for one more cycle
+            inline void update_buffers() {
+                if (_changed.load(std::memory_order_acquire)) {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    _cycle_buffers = _buffers;
+                    _cycle_buffers.insert(_cycle_buffers.end(), _removed.begin(), _removed.end());
+                    _changed.store(!_removed.empty(), std::memory_order_relaxed);
+                    _removed.clear();
+                }
+            }
+
+            inline void cycle() {
+                const bool with_time = EFP_LOG_TIME_STAMP == true;
+
+                for (auto& buffer : _cycle_buffers) {
+                    buffer->begin_cycle(with_time);
+                }
+
+                bool pending = true;
+                while (pending) {
+                    stop_on_crash();
+                    pending = false;
+                    for (auto& buffer : _cycle_buffers) {
+                        pending = buffer->drain(drain_quota, with_time) || pending;
+                    }
+
+                    // Loggers done with their snapshot write it out and pick up new records
+                    // while the others catch up
+                    if (pending) {
+                        for (auto& buffer : _cycle_buffers) {
+                            if (buffer->empty()) {
+                                buffer->flush_output();
+                                buffer->begin_cycle(with_time);
+                            }
+                        }
+                    }
+                }
+
+                for (auto& buffer : _cycle_buffers) {
+                    buffer->flush_output();
+                }
+            }
+
+            // Writes what has been formatted and leaves the queues to the crash handler until
+            // the process ends
+            inline void stop_on_crash() {
+                if (current_backend() != this || !crash_requested().load(std::memory_order_acquire)) {
+                    return;
+                }
+
+                for (auto& buffer : _cycle_buffers) {
+                    buffer->flush_output();
+                }
+                _state.store(stopped, std::memory_order_release);
+                halt();
+            }
+
+            static inline void halt() {
+                while (true) {
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+                }
+            }
+
+            // Applies the CPU and priority of the thread when they change.
+            // Failures are reported in the log of config_source.
+            void place(const LoggerConfig& config, int& backend_cpu, int& backend_priority) {
+                const int cpu = config.backend_cpu < 0 ? -1 : config.backend_cpu + static_cast<int>(_index);
+                if (cpu != backend_cpu) {
+                    backend_cpu = cpu;
+                    if (backend_cpu >= 0 && !pin_current_thread(backend_cpu)) {
+                        _config_source->enqueue(LogLevel::Warn,
+                                                "Can not pin the backend thread to CPU {}",
+                                                backend_cpu);
+                    }
+                }
+
+                if (config.backend_priority != backend_priority) {
+                    backend_priority = config.backend_priority;
+                    if (!set_current_thread_priority(backend_priority)) {
+                        _config_source->enqueue(LogLevel::Warn,
+                                                "Can not set the backend thread priority to {}",
+                                                backend_priority);
+                    }
+                }
+            }
+
+            const unsigned _index;
+            std::shared_ptr<LogBuffer> _config_source;
+            WakeupSignal _wakeup;
+            // Buffers as assigned, copied into _cycle_buffers by the thread
+            std::mutex _mutex;
+            std::vector<std::shared_ptr<LogBuffer>> _buffers;
+            std::vector<std::shared_ptr<LogBuffer>> _removed;
+            std::atomic<bool> _changed;
+            std::vector<std::shared_ptr<LogBuffer>> _cycle_buffers;
+            FormatPool _format_pool;
+            // Stopped by the crash handler while idle, or by the thread itself
+            static constexpr int running = 0;
+            static constexpr int idle = 1;
+            static constexpr int stopped = 2;
+            std::atomic<int> _state{running};
+            std::atomic<bool> _run;
+            std::thread _thread;
+        };
+
+    } // namespace detail
+
+    // Logger with its own queues, level and sinks, made by Logger::create() and drained by
+    // the backend threads of Logger. The free functions log to Logger::default_logger().
+    class NamedLogger {
+    public:
+        // Only Logger can make one, as a logger no backend thread drains would never write
+        class Key {
+            friend class Logger;
+            Key() {}
+        };
+
+        NamedLogger(Key, std::string name, const LoggerConfig& config) : _name(std::move(name)) {
+            _log_buffer.set_config(config);
+        }
+
+        NamedLogger(const NamedLogger& other) = delete;
+        NamedLogger& operator=(const NamedLogger& other) = delete;
+
+        inline const std::string& name() const { return _name; }
+
+        inline void set_log_level(LogLevel log_level) { _log_buffer.set_log_level(log_level); }
+
+        inline LogLevel get_log_level() { return _log_buffer.get_log_level(); }
+
+        // Default is TimePrecision::Sec
+        inline void set_time_precision(TimePrecision precision) {
+            _log_buffer.set_time_precision(precision);
+        }
+
+        inline TimePrecision get_time_precision() const { return _log_buffer.get_time_precision(); }
+
+        // Replaces every sink with the file
+        inline void set_output(FILE* output_file) { _log_buffer.set_output_file(output_file); }
+
+        // Returns false and keeps the current sinks if the file can not be opened
+        inline bool set_output(const char* path) {
+            auto sink = std::make_shared<FileSink>(path);
+            if (!sink->is_open()) {
+                return false;
+            }
+            _log_buffer.set_sink(std::move(sink));
+            return true;
+        }
+
+        // Records pass the logger level at the call, then the level of each sink on the backend.
+        // Sink changes take effect on the next backend cycle.
+        inline void set_sink(std::shared_ptr<Sink> sink) { _log_buffer.set_sink(std::move(sink)); }
+
+        inline void add_sink(std::shared_ptr<Sink> sink) { _log_buffer.add_sink(std::move(sink)); }
+
+        inline void remove_sink(const std::shared_ptr<Sink>& sink) { _log_buffer.remove_sink(sink); }
+
+        // Default is OutputFormat::Text. Applies to every sink.
+        inline void set_output_format(OutputFormat output_format) {
+            _log_buffer.set_output_format(output_format);
+        }
+
+        inline OutputFormat get_output_format() { return _log_buffer.get_output_format(); }
+
+        // The queue settings should be set before logging, as queues already created keep
+        // their configuration
+        inline void set_config(const LoggerConfig& config) { _log_buffer.set_config(config); }
+
+        inline LoggerConfig get_config() { return _log_buffer.get_config(); }
+
+        // Total number of records dropped or overwritten on queue overflow
+        inline uint64_t dropped_count() const { return _log_buffer.dropped_count(); }
+
+        // Counters of the producers and the backend. Takes a lock, not meant for the hot path.
+        inline LoggerStats stats() { return _log_buffer.stats(); }
+
+        // Prints the records kept by the flight recorder of every thread, oldest first
+        inline void dump_flight_recorder() { _log_buffer.dump_flight_recorder(); }
+
+        // Makes the queues of the calling thread with the current config. Otherwise they are
+        // made and prefaulted by its first record.
+        inline void prepare_thread() { _log_buffer.prepare_thread(); }
+
+        // Waits until the records logged before the call are written to the sinks, for at most
+        // timeout. Returns false on timeout. Records below the flight recorder level are not
+        // waited for.
+        inline bool flush(std::chrono::milliseconds timeout = std::chrono::seconds(1)) {
+            return _log_buffer.flush(timeout);
+        }
+
+        template <typename... Args>
+        inline void trace(const char* fmt_str, const Args&... args) {
+            log(LogLevel::Trace, fmt_str, args...);
+        }
+
+        template <typename... Args>
+        inline void debug(const char* fmt_str, const Args&... args) {
+            log(LogLevel::Debug, fmt_str, args...);
+        }
+
+        template <typename... Args>
+        inline void info(const char* fmt_str, const Args&... args) {
+            log(LogLevel::Info, fmt_str, args...);
+        }
+
+        template <typename... Args>
+        inline void warn(const char* fmt_str, const Args&... args) {
+            log(LogLevel::Warn, fmt_str, args...);
+        }
+
+        template <typename... Args>
+        inline void error(const char* fmt_str, const Args&... args) {
+            log(LogLevel::Error, fmt_str, args...);
+        }
+
+        template <typename... Args>
+        inline void fatal(const char* fmt_str, const Args&... args) {
+            log(LogLevel::Fatal, fmt_str, args...);
+        }
+
+        template <typename... Args>
+        inline void log(LogLevel level, const char* fmt_str, const Args&... args) {
+            if (level >= active_log_level && _log_buffer.accepts(level)) {
+                _log_buffer.enqueue(level, fmt_str, args...);
+            }
+        }
+
+        // The format string is already in the call site
+        template <typename... Args>
+        inline void log_call_site(const detail::CallSite* site, const char*, const Args&... args) {
+            if (_log_buffer.accepts(site->level)) {
+                _log_buffer.enqueue(site, args...);
+            }
+        }
+
+        // Counts the call at the rate limiter before encoding anything
+        template <typename... Args>
+        inline void log_rate_limited(detail::RateLimiter& limiter, const char*, const Args&... args) {
+            const detail::CallSite* site = limiter.site();
+            if (!_log_buffer.accepts(site->level)) {
+                return;
+            }
+            if (limiter.allow()) {
+                _log_buffer.enqueue(site, args...);
+            } else if (limiter.claim_registration()) {
+                _log_buffer.add_rate_limiter(&limiter);
+            }
+        }
+
+        // Shares the ownership of the logger with the backend
+        static inline std::shared_ptr<detail::LogBuffer>
+        log_buffer(const std::shared_ptr<NamedLogger>& logger) {
+            return std::shared_ptr<detail::LogBuffer>(logger, &logger->_log_buffer);
+        }
+
+    private:
+        const std::string _name;
+        detail::LogBuffer _log_buffer;
+    };
+
+    // Owns the loggers and the pool of backend threads draining them. The static functions
+    // below apply to the default logger.
+    class Logger {
+    public:
+        ~Logger() {
+            for (auto& worker : _workers) {
+                worker->stop();
+            }
+        }
+
+        static inline Logger& instance() {
+            static Logger inst{};
+            return inst;
+        }
+
+        // Makes the logger with the config, starts its backend threads and prepares the queues
+        // of the calling thread, so that no log call pays for them. Other logging threads
+        // should call prepare_thread() before their first record.
+        static void init(const LoggerConfig& config = LoggerConfig{}) {
+            set_config(config);
+            prepare_thread();
+        }
+
+        static inline void prepare_thread() { default_logger().prepare_thread(); }
+
+        // Names the calling thread in the records of every logger with LoggerConfig::log_thread.
+        // Meant to be called once per thread. The backend picks it up on its next cycle.
+        static inline void set_thread_name(std::string name) {
+            detail::ThreadRegistry::instance().set_name(detail::current_thread_index(), std::move(name));
+        }
+
+        // Logger of the free functions and the EFP_LOG_* macros, named "default"
+        static inline NamedLogger& default_logger() { return *instance()._default_logger; }
+
+        // Returns the logger of the name, made with the config if there is none yet.
+        // Its queues, level and sinks are independent of the other loggers. The backend
+        // settings of the config are not used.
+        static std::shared_ptr<NamedLogger> create(const std::string& name,
+                                                   const LoggerConfig& config = LoggerConfig{}) {
+            Logger& self = instance();
+            std::lock_guard<std::mutex> lock(self._mutex);
+
+            auto it = self._loggers.find(name);
+            if (it != self._loggers.end()) {
+                return it->second;
+            }
+
+            auto logger = std::make_shared<NamedLogger>(NamedLogger::Key(), name, config);
+            self.least_loaded_worker().add(NamedLogger::log_buffer(logger));
+            self._loggers.emplace(name, logger);
+            return logger;
+        }
+
+        // nullptr if there is no logger of the name
+        static std::shared_ptr<NamedLogger> get(const std::string& name) {
+            Logger& self = instance();
+            std::lock_guard<std::mutex> lock(self._mutex);
+
+            auto it = self._loggers.find(name);
+            return it != self._loggers.end() ? it->second : nullptr;
+        }
+
+        // The backend drains the logger once more and releases it. Records logged to it
+        // afterwards are not written. The default logger can not be removed.
+        static void remove(const std::string& name) {
+            Logger& self = instance();
+            std::lock_guard<std::mutex> lock(self._mutex);
+
+            auto it = self._loggers.find(name);
+            if (it == self._loggers.end() || it->second == self._default_logger) {
+                return;
+            }
+
+            const detail::LogBuffer* buffer = NamedLogger::log_buffer(it->second).get();
+            {
+                std::lock_guard<std::mutex> worker_lock(self._worker_mutex);
+                for (auto& worker : self._workers) {
+                    worker->remove(buffer);
+                }
+            }
+            self._loggers.erase(it);
+        }
+
+        static inline void set_log_level(LogLevel log_level) {
+            default_logger().set_log_level(log_level);
+        }
+
+        static inline LogLevel get_log_level() { return default_logger().get_log_level(); }
+
+        // Default is TimePrecision::Sec
+        static inline void set_time_precision(TimePrecision precision) {
+            default_logger().set_time_precision(precision);
+        }
+
+        static inline TimePrecision get_time_precision() {
+            return default_logger().get_time_precision();
+        }
+
+        // Replaces every sink with the file
+        static void set_output(FILE* output_file) { default_logger().set_output(output_file); }
+
+        // Returns false and keeps the current sinks if the file can not be opened
+        static bool set_output(const char* path) { return default_logger().set_output(path); }
+
+        // Records pass the logger level at the call, then the level of each sink on the backend.
+        // Sink changes take effect on the next backend cycle.
+        static inline void set_sink(std::shared_ptr<Sink> sink) {
+            default_logger().set_sink(std::move(sink));
+        }
+
+        static inline void add_sink(std::shared_ptr<Sink> sink) {
+            default_logger().add_sink(std::move(sink));
+        }
+
+        static inline void remove_sink(const std::shared_ptr<Sink>& sink) {
+            default_logger().remove_sink(sink);
+        }
+
+        // Default is OutputFormat::Text. Applies to every sink.
+        static inline void set_output_format(OutputFormat output_format) {
+            default_logger().set_output_format(output_format);
+        }
+
+        static inline OutputFormat get_output_format() {
+            return default_logger().get_output_format();
+        }
+
+        // The queue settings should be set before logging, as queues already created keep
+        // their configuration. The backend settings apply to every logger from the next
+        // backend cycle, and backend_threads above the current number starts more threads.
+        static inline void set_config(const LoggerConfig& config) {
+            default_logger().set_config(config);
+            instance().grow_workers(config.backend_threads);
+        }
+
+        static inline LoggerConfig get_config() { return default_logger().get_config(); }
+
+        // Total number of records of the default logger dropped or overwritten on queue overflow
+        static inline uint64_t dropped_count() { return default_logger().dropped_count(); }
+
+        static inline LoggerStats stats() { return default_logger().stats(); }
+
+        static inline void dump_flight_recorder() { default_logger().dump_flight_recorder(); }
+
+        // Waits until the records logged to every logger before the call are written to the
+        // sinks, for at most timeout in total. Returns false on timeout.
+        static bool flush(std::chrono::milliseconds timeout = std::chrono::seconds(1)) {
+            Logger& self = instance();
+            std::vector<std::shared_ptr<NamedLogger>> loggers;
+            {
+                std::lock_guard<std::mutex> lock(self._mutex);
+                for (const auto& entry : self._loggers) {
+                    loggers.push_back(entry.second);
+                }
+            }
+
+            const auto deadline = std::chrono::steady_clock::now() + timeout;
+            bool flushed = true;
+            for (const auto& logger : loggers) {
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now());
+                if (remaining.count() < 0) {
+                    remaining = std::chrono::milliseconds(0);
+                }
+                flushed = logger->flush(remaining) && flushed;
+            }
+            return flushed;
+        }
+
+        // Opt-in. On SIGSEGV, SIGBUS, SIGFPE, SIGILL and SIGABRT, writes the records still in
+        // the queues and flight recorders of every logger as text, then raises the signal again
+        // with the handler it replaced. See LogBuffer::crash_drain() for where they go.
+        // Returns false where it is not supported. POSIX only.
+        static bool install_crash_handler() {
+#if defined(__unix__) || defined(__APPLE__)
+            static std::atomic<bool> installed{false};
+            if (installed.exchange(true)) {
+                return true;
+            }
+
+            instance();
+            detail::crash_line();
+
+            struct sigaction action;
+            std::memset(&action, 0, sizeof(action));
+            action.sa_handler = &Logger::handle_crash;
+            sigemptyset(&action.sa_mask);
+            action.sa_flags = SA_ONSTACK;
+            for (int i = 0; i < crash_signal_num; ++i) {
+                sigaction(crash_signals()[i], &action, &previous_crash_actions()[i]);
+            }
+            return true;
+#else
+            return false;
+#endif
+        }
+
+    private:
+        Logger()
+            : _default_logger(
+                  std::make_shared<NamedLogger>(NamedLogger::Key(), "default", LoggerConfig{})) {
+            _loggers.emplace(_default_logger->name(), _default_logger);
+            grow_workers(1);
+            _workers[0]->add(NamedLogger::log_buffer(_default_logger));
+        }
+
+        inline void grow_workers(unsigned worker_num) {
+            std::lock_guard<std::mutex> lock(_worker_mutex);
+            while (_workers.size() < worker_num) {
+                _workers.emplace_back(new detail::BackendWorker(
+                    static_cast<unsigned>(_workers.size()), NamedLogger::log_buffer(_default_logger)));
+            }
+        }
+
+        // New loggers go to the thread with the fewest loggers
+        inline detail::BackendWorker& least_loaded_worker() {
+            std::lock_guard<std::mutex> lock(_worker_mutex);
+            detail::BackendWorker* result = _workers[0].get();
+            size_t min_size = result->size();
+            for (auto& worker : _workers) {
+                const size_t size = worker->size();
+                if (size < min_size) {
+                    result = worker.get();
+                    min_size = size;
+                }
+            }
+            return *result;
+        }
+
+#if defined(__unix__) || defined(__APPLE__)
+        static constexpr int crash_signal_num = 5;
+
+        static inline const int* crash_signals() {
+            static const int signals[crash_signal_num] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+            return signals;
+        }
+
+        static inline struct sigaction* previous_crash_actions() {
+            static struct sigaction actions[crash_signal_num];
+            return actions;
+        }
+
+        // The first crashing thread drains the queues. Others wait for it to end the process,
+        // and a crash while draining ends it right away.
+        static void handle_crash(int signal) {
+            static thread_local bool crashing = false;
+            if (!crashing) {
+                crashing = true;
+                if (detail::crash_requested().exchange(true, std::memory_order_acq_rel)) {
+                    while (true) {
+                        pause();
+                    }
+                }
+                instance().crash_drain();
+            }
+
+            for (int i = 0; i < crash_signal_num; ++i) {
+                if (crash_signals()[i] == signal) {
+                    sigaction(signal, &previous_crash_actions()[i], nullptr);
+                }
+            }
+            raise(signal);
+        }
+
+        // The workers are only added to, and the lock may be held by the crashed thread
+        inline void crash_drain() {
+            const auto deadline = std::chrono::steady_clock::now() + detail::crash_stop_timeout;
+            for (auto& worker : _workers) {
+                worker->crash_drain(deadline);
+            }
+        }
+#endif
+
+        std::shared_ptr<NamedLogger> _default_logger;
+        // Guards _loggers
+        std::mutex _mutex;
+        std::unordered_map<std::string, std::shared_ptr<NamedLogger>> _loggers;
+        std::mutex _worker_mutex;
+        std::vector<std::unique_ptr<detail::BackendWorker>> _workers;
+    };
+
+    namespace detail {
+        inline NamedLogger& logger_ref(NamedLogger& logger) { return logger; }
+
+        inline NamedLogger& logger_ref(const std::shared_ptr<NamedLogger>& logger) { return *logger; }
+    } // namespace detail
+
+    template <typename... Args>
+    inline void trace(const char* fmt_str, const Args&... args) {
+        Logger::default_logger().trace(fmt_str, args...);
+    }
+
+    template <typename... Args>
+    inline void debug(const char* fmt_str, const Args&... args) {
+        Logger::default_logger().debug(fmt_str, args...);
+    }
+
+    template <typename... Args>
+    inline void info(const char* fmt_str, const Args&... args) {
+        Logger::default_logger().info(fmt_str, args...);
     }
 
     template <typename... Args>
     inline void warn(const char* fmt_str, const Args&... args) {
-        detail::enqueue_log(LogLevel::Warn, fmt_str, args...);
+        Logger::default_logger().warn(fmt_str, args...);
     }
 
     template <typename... Args>
     inline void error(const char* fmt_str, const Args&... args) {
-        detail::enqueue_log(LogLevel::Error, fmt_str, args...);
+        Logger::default_logger().error(fmt_str, args...);
     }
 
     template <typename... Args>
     inline void fatal(const char* fmt_str, const Args&... args) {
-        detail::enqueue_log(LogLevel::Fatal, fmt_str, args...);
+        Logger::default_logger().fatal(fmt_str, args...);
     }
 }; // namespace efp
 
+// Call-site macros. The format string has to be a string literal. EFP_LOGGER_* take a
+// NamedLogger or a shared_ptr of it first.
+// Disabled levels expand to nothing and the arguments are not evaluated.
+
+#define EFP_LOG_FIRST_ARG_(first, ...) first
+
+#define EFP_LOG_CALL_SITE_TO_(logger, log_level, ...)                                  \
+    do {                                                                                \
+        static const ::efp::detail::CallSite efp_log_call_site_{                        \
+            EFP_LOG_FIRST_ARG_(__VA_ARGS__, 0),                                         \
+            log_level,                                                                  \
+            __FILE__,                                                                   \
+            __LINE__,                                                                   \
+            decltype(::efp::detail::arg_signature(__VA_ARGS__))::arg_num,               \
+            decltype(::efp::detail::arg_signature(__VA_ARGS__))::types,                 \
+        };                                                                              \
+        ::efp::detail::logger_ref(logger).log_call_site(&efp_log_call_site_, __VA_ARGS__); \
+    } while (false)
+
+#define EFP_LOG_CALL_SITE_(log_level, ...) \
+    EFP_LOG_CALL_SITE_TO_(::efp::Logger::default_logger(), log_level, __VA_ARGS__)
+
+#define EFP_LOG_RATE_LIMITED_TO_(logger, log_level, first_n, every_n, interval, ...)        \
+    do {                                                                                     \
+        if (static_cast<int>(log_level) >= EFP_LOG_ACTIVE_LEVEL) {                           \
+            static const ::efp::detail::CallSite efp_log_call_site_{                         \
+                EFP_LOG_FIRST_ARG_(__VA_ARGS__, 0),                                          \
+                log_level,                                                                   \
+                __FILE__,                                                                    \
+                __LINE__,                                                                    \
+                decltype(::efp::detail::arg_signature(__VA_ARGS__))::arg_num,                \
+                decltype(::efp::detail::arg_signature(__VA_ARGS__))::types,                  \
+            };                                                                               \
+            static ::efp::detail::RateLimiter efp_log_rate_limiter_(                         \
+                &efp_log_call_site_, first_n, every_n, interval);                            \
+            ::efp::detail::logger_ref(logger).log_rate_limited(efp_log_rate_limiter_,        \
+                                                               __VA_ARGS__);                 \
+        }                                                                                    \
+    } while (false)
+
+// Rate limited call-site macros, taking the level first. Suppressed records are summed up
+// per call site by the backend every LoggerConfig::suppressed_period.
+
+// Logs the 1st, the n+1-th, the 2n+1-th... occurrence
+#define EFP_LOG_EVERY_N(log_level, n, ...) \
+    EFP_LOGGER_EVERY_N(::efp::Logger::default_logger(), log_level, n, __VA_ARGS__)
+#define EFP_LOGGER_EVERY_N(logger, log_level, n, ...) \
+    EFP_LOG_RATE_LIMITED_TO_(logger, log_level, 0, n, ::std::chrono::seconds(0), __VA_ARGS__)
+
+// Logs at most one occurrence per interval, a std::chrono::duration
+#define EFP_LOG_ONCE_EVERY(log_level, interval, ...) \
+    EFP_LOGGER_ONCE_EVERY(::efp::Logger::default_logger(), log_level, interval, __VA_ARGS__)
+#define EFP_LOGGER_ONCE_EVERY(logger, log_level, interval, ...) \
+    EFP_LOG_RATE_LIMITED_TO_(logger, log_level, 0, 0, interval, __VA_ARGS__)
+
+// Logs the first first_n occurrences, then every n-th one
+#define EFP_LOG_FIRST_N_THEN_EVERY(log_level, first_n, n, ...) \
+    EFP_LOGGER_FIRST_N_THEN_EVERY(::efp::Logger::default_logger(), log_level, first_n, n, __VA_ARGS__)
+#define EFP_LOGGER_FIRST_N_THEN_EVERY(logger, log_level, first_n, n, ...) \
+    EFP_LOG_RATE_LIMITED_TO_(logger, log_level, first_n, n, ::std::chrono::seconds(0), __VA_ARGS__)
+
+#if EFP_LOG_ACTIVE_LEVEL <= EFP_LOG_LEVEL_TRACE
+#define EFP_LOG_TRACE(...) EFP_LOG_CALL_SITE_(::efp::LogLevel::Trace, __VA_ARGS__)
+#define EFP_LOGGER_TRACE(logger, ...) EFP_LOG_CALL_SITE_TO_(logger, ::efp::LogLevel::Trace, __VA_ARGS__)
+#else
+#define EFP_LOG_TRACE(...) (void)0
+#define EFP_LOGGER_TRACE(logger, ...) (void)0
+#endif
+
+#if EFP_LOG_ACTIVE_LEVEL <= EFP_LOG_LEVEL_DEBUG
+#define EFP_LOG_DEBUG(...) EFP_LOG_CALL_SITE_(::efp::LogLevel::Debug, __VA_ARGS__)
+#define EFP_LOGGER_DEBUG(logger, ...) EFP_LOG_CALL_SITE_TO_(logger, ::efp::LogLevel::Debug, __VA_ARGS__)
+#else
+#define EFP_LOG_DEBUG(...) (void)0
+#define EFP_LOGGER_DEBUG(logger, ...) (void)0
+#endif
+
+#if EFP_LOG_ACTIVE_LEVEL <= EFP_LOG_LEVEL_INFO
+#define EFP_LOG_INFO(...) EFP_LOG_CALL_SITE_(::efp::LogLevel::Info, __VA_ARGS__)
+#define EFP_LOGGER_INFO(logger, ...) EFP_LOG_CALL_SITE_TO_(logger, ::efp::LogLevel::Info, __VA_ARGS__)
+#else
+#define EFP_LOG_INFO(...) (void)0
+#define EFP_LOGGER_INFO(logger, ...) (void)0
+#endif
+
+#if EFP_LOG_ACTIVE_LEVEL <= EFP_LOG_LEVEL_WARN
+#define EFP_LOG_WARN(...) EFP_LOG_CALL_SITE_(::efp::LogLevel::Warn, __VA_ARGS__)
+#define EFP_LOGGER_WARN(logger, ...) EFP_LOG_CALL_SITE_TO_(logger, ::efp::LogLevel::Warn, __VA_ARGS__)
+#else
+#define EFP_LOG_WARN(...) (void)0
+#define EFP_LOGGER_WARN(logger, ...) (void)0
+#endif
+
+#if EFP_LOG_ACTIVE_LEVEL <= EFP_LOG_LEVEL_ERROR
+#define EFP_LOG_ERROR(...) EFP_LOG_CALL_SITE_(::efp::LogLevel::Error, __VA_ARGS__)
+#define EFP_LOGGER_ERROR(logger, ...) EFP_LOG_CALL_SITE_TO_(logger, ::efp::LogLevel::Error, __VA_ARGS__)
+#else
+#define EFP_LOG_ERROR(...) (void)0
+#define EFP_LOGGER_ERROR(logger, ...) (void)0
+#endif
+
+#if EFP_LOG_ACTIVE_LEVEL <= EFP_LOG_LEVEL_FATAL
+#define EFP_LOG_FATAL(...) EFP_LOG_CALL_SITE_(::efp::LogLevel::Fatal, __VA_ARGS__)
+#define EFP_LOGGER_FATAL(logger, ...) EFP_LOG_CALL_SITE_TO_(logger, ::efp::LogLevel::Fatal, __VA_ARGS__)
+#else
+#define EFP_LOG_FATAL(...) (void)0
+#define EFP_LOGGER_FATAL(logger, ...) (void)0
+#endif
+
 #endif
\ No newline at end of file
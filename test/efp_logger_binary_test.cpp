@@ -0,0 +1,154 @@
+// Binary output decoded by efp_logger_decode matches the text output, including a file which
+// two outputs are appended to, a format string replaced at the same address, specs on user
+// types and a sink shared by loggers on different backend threads.
+// Usage: efp_logger_binary_test <efp_logger_decode> <binary file>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    struct Quote {
+        int bid;
+        int ask;
+    };
+} // namespace
+
+// Takes the specs of a string
+template <>
+struct fmt::formatter<Quote> : fmt::formatter<fmt::string_view> {
+    auto format(const Quote& quote, fmt::format_context& ctx) const -> decltype(ctx.out()) {
+        const std::string text = fmt::format("{}/{}", quote.bid, quote.ask);
+        return fmt::formatter<fmt::string_view>::format(text, ctx);
+    }
+};
+
+namespace {
+    std::string read_file(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        return contents.str();
+    }
+
+    // One output of the process, as a new FileSink appending to the file
+    void log_output(const std::string& path, int output, const std::shared_ptr<MemorySink>& text) {
+        auto binary = std::make_shared<FileSink>(path.c_str());
+        EFP_TEST_CHECK(binary->is_open());
+        Logger::set_sink(binary);
+        binary->set_format(OutputFormat::Binary);
+        Logger::add_sink(text);
+
+        for (int i = 0; i < 100; ++i) {
+            info("output {} record {} of {:.3f}", output, i, i * 0.5);
+            warn("{:>8} {} {}", std::string("text"), Quote{i, i + 1}, "literal", kv("id", i));
+            info("quote {:>12} {:<{}}|", Quote{i, i + 1}, Quote{i, i}, 9);
+        }
+        debug("not logged");
+        error("{{escaped}} {}", 'c');
+
+        // A format string which is not a literal, changed once the first record is written
+        char fmt_str[32] = "first {}";
+        info(fmt_str, 1);
+        EFP_TEST_CHECK(Logger::flush());
+        std::strcpy(fmt_str, "second {:>3}");
+        info(fmt_str, 2);
+        EFP_TEST_CHECK(Logger::flush());
+    }
+
+    std::vector<std::string> sorted_lines(const std::string& contents) {
+        std::vector<std::string> lines;
+        std::istringstream stream(contents);
+        std::string line;
+        while (std::getline(stream, line)) {
+            lines.push_back(line);
+        }
+        std::sort(lines.begin(), lines.end());
+        return lines;
+    }
+
+    // Two loggers on different backend threads take turns writing to one binary sink. Their
+    // batches are in no set order, so the lines are compared sorted.
+    void shared_sink(const std::string& decoder, const std::string& path) {
+        const std::string decoded_path = path + ".txt";
+        std::remove(path.c_str());
+
+        auto binary = std::make_shared<FileSink>(path.c_str());
+        EFP_TEST_CHECK(binary->is_open());
+        binary->set_format(OutputFormat::Binary);
+        auto text = std::make_shared<MemorySink>(1 << 20);
+
+        auto first = Logger::create("first");
+        auto second = Logger::create("second");
+        for (auto* logger : {first.get(), second.get()}) {
+            logger->set_time_precision(TimePrecision::Nano);
+            logger->set_sink(binary);
+            logger->add_sink(text);
+        }
+
+        for (int round = 0; round < 10; ++round) {
+            for (int i = 0; i < 20; ++i) {
+                first->info("first round {} record {}", round, i);
+                second->info("second {} round {} record {}", round * 0.5, round, i);
+            }
+            EFP_TEST_CHECK(first->flush());
+            EFP_TEST_CHECK(second->flush());
+        }
+        Logger::remove("first");
+        Logger::remove("second");
+        binary.reset();
+
+        const std::string command = decoder + " " + path + " " + decoded_path;
+        EFP_TEST_CHECK(std::system(command.c_str()) == 0);
+
+        const std::vector<std::string> decoded = sorted_lines(read_file(decoded_path));
+        EFP_TEST_CHECK(decoded.size() == 400);
+        EFP_TEST_CHECK(decoded == sorted_lines(text->contents()));
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::fprintf(stderr, "Usage: %s <efp_logger_decode> <binary file>\n", argv[0]);
+        return 1;
+    }
+    const std::string decoder = argv[1];
+    const std::string path = argv[2];
+    const std::string decoded_path = path + ".txt";
+    std::remove(path.c_str());
+
+    // Every record is compared, so none may be dropped
+    LoggerConfig config;
+    config.overflow_policy = OverflowPolicy::Block;
+    config.backend_threads = 2;
+    Logger::init(config);
+    Logger::set_time_precision(TimePrecision::Nano);
+    auto text = std::make_shared<MemorySink>(1 << 20);
+
+    log_output(path, 0, text);
+    log_output(path, 1, text);
+    Logger::set_output(stdout);
+    EFP_TEST_CHECK(Logger::flush());
+
+    const std::string command = decoder + " " + path + " " + decoded_path;
+    EFP_TEST_CHECK(std::system(command.c_str()) == 0);
+
+    const std::string decoded = read_file(decoded_path);
+    EFP_TEST_CHECK(decoded.find("output 1 record 99 of 49.500") != std::string::npos);
+    EFP_TEST_CHECK(decoded.find("second   2") != std::string::npos);
+    EFP_TEST_CHECK(decoded.find("quote       99/100 99/99    |") != std::string::npos);
+    EFP_TEST_CHECK(decoded == text->contents());
+
+    shared_sink(decoder, path + ".shared");
+    return efp_test::result();
+}
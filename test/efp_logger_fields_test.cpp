@@ -0,0 +1,68 @@
+// kv() fields in text and JSON output
+
+#include <memory>
+#include <string>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    bool contains(const std::string& contents, const char* str) {
+        return contents.find(str) != std::string::npos;
+    }
+
+    // Every line is one object
+    bool json_lines(const std::string& contents) {
+        size_t begin = 0;
+        while (begin < contents.size()) {
+            const size_t end = contents.find('\n', begin);
+            if (end == std::string::npos || contents.compare(begin, 9, "{\"time\":\"") != 0 ||
+                contents[end - 1] != '}') {
+                return false;
+            }
+            begin = end + 1;
+        }
+        return !contents.empty();
+    }
+
+    void fields() {
+        auto logger = Logger::create("fields");
+        auto text = std::make_shared<MemorySink>(1 << 16);
+        auto json = std::make_shared<MemorySink>(1 << 16);
+        json->set_format(OutputFormat::Json);
+        logger->set_sink(text);
+        logger->add_sink(json);
+
+        logger->info("order {} filled", 7, kv("id", 42), kv("px", 101.25), kv("venue", "XNYS"),
+                     kv("note", std::string("two words")));
+        logger->warn("say {}", "\"hi\"\tthere\n", kv("ok", true), kv("empty", ""));
+        logger->error("no fields");
+        EFP_TEST_CHECK(logger->flush());
+
+        // Strings which would not read back as one value are quoted
+        const std::string text_contents = text->contents();
+        EFP_TEST_CHECK(contains(text_contents,
+                                "INFO  order 7 filled id=42 px=101.25 venue=XNYS note=\"two words\"\n"));
+        EFP_TEST_CHECK(contains(text_contents, " ok=true empty=\"\"\n"));
+        EFP_TEST_CHECK(contains(text_contents, "ERROR no fields\n"));
+
+        const std::string json_contents = json->contents();
+        EFP_TEST_CHECK(json_lines(json_contents));
+        EFP_TEST_CHECK(contains(json_contents,
+                                "\"level\":\"INFO\",\"message\":\"order 7 filled\",\"id\":42,"
+                                "\"px\":101.25,\"venue\":\"XNYS\",\"note\":\"two words\"}\n"));
+        EFP_TEST_CHECK(contains(json_contents,
+                                "\"level\":\"WARN\",\"message\":\"say \\\"hi\\\"\\tthere\\n\","
+                                "\"ok\":true,\"empty\":\"\"}\n"));
+        EFP_TEST_CHECK(contains(json_contents, "\"level\":\"ERROR\",\"message\":\"no fields\"}\n"));
+    }
+} // namespace
+
+int main() {
+    Logger::init();
+
+    fields();
+    return efp_test::result();
+}
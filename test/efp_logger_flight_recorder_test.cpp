@@ -0,0 +1,122 @@
+// Records kept by the flight recorder and printed on a trigger or a dump
+
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    // The numbers logged as "<prefix> {}", in output order
+    std::vector<int> logged_numbers(const std::string& contents, const std::string& prefix) {
+        std::vector<int> numbers;
+        std::istringstream stream(contents);
+        std::string line;
+        while (std::getline(stream, line)) {
+            const size_t pos = line.find(prefix);
+            if (pos != std::string::npos) {
+                numbers.push_back(std::stoi(line.substr(pos + prefix.size())));
+            }
+        }
+        return numbers;
+    }
+
+    size_t count(const std::string& contents, const std::string& str) {
+        size_t num = 0;
+        for (size_t pos = contents.find(str); pos != std::string::npos;
+             pos = contents.find(str, pos + 1)) {
+            ++num;
+        }
+        return num;
+    }
+
+    // The backend dumps in its own cycle, which a flush does not wait for
+    bool wait_for_output(NamedLogger& logger, const MemorySink& sink, const char* str) {
+        for (int i = 0; i < 300; ++i) {
+            logger.flush();
+            if (sink.contents().find(str) != std::string::npos) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    std::shared_ptr<NamedLogger> make_logger(const std::string& name, size_t capacity,
+                                             std::shared_ptr<MemorySink>& sink) {
+        LoggerConfig config;
+        config.flight_recorder_level = LogLevel::Info;
+        config.flight_recorder_capacity = capacity;
+        auto logger = Logger::create(name, config);
+        sink = std::make_shared<MemorySink>(1 << 20);
+        logger->set_sink(sink);
+        return logger;
+    }
+
+    // Recorded records of every thread are printed oldest first before the trigger, and each
+    // at most once
+    void trigger_and_dump() {
+        std::shared_ptr<MemorySink> sink;
+        auto logger = make_logger("trigger_and_dump", 1 << 16, sink);
+
+        logger->debug("parsed {}", 0);
+        std::thread other([&]() { logger->trace("parsed {}", 1); });
+        other.join();
+        logger->debug("parsed {}", 2);
+        logger->info("printed");
+        EFP_TEST_CHECK(logger->flush());
+        EFP_TEST_CHECK(sink->contents().find("parsed") == std::string::npos);
+        EFP_TEST_CHECK(sink->contents().find("printed") != std::string::npos);
+
+        logger->error("checksum mismatch");
+        EFP_TEST_CHECK(logger->flush());
+        std::string contents = sink->contents();
+        const size_t begin = contents.find("efp logger flight recorder dump begins");
+        const size_t end = contents.find("efp logger flight recorder dump ends with 3 records");
+        const size_t trigger = contents.find("checksum mismatch");
+        EFP_TEST_CHECK(begin != std::string::npos && begin < end && end < trigger &&
+                       trigger != std::string::npos);
+        EFP_TEST_CHECK(logged_numbers(contents, "parsed ") == std::vector<int>({0, 1, 2}));
+        EFP_TEST_CHECK(contents.find("parsed 0") > begin && contents.find("parsed 2") < end);
+
+        logger->debug("later {}", 3);
+        logger->dump_flight_recorder();
+        EFP_TEST_CHECK(wait_for_output(*logger, *sink, "dump ends with 1 records"));
+        contents = sink->contents();
+        EFP_TEST_CHECK(logged_numbers(contents, "later ") == std::vector<int>({3}));
+        EFP_TEST_CHECK(count(contents, "parsed 0") == 1);
+    }
+
+    // A full ring keeps the latest records
+    void overwrite_oldest() {
+        std::shared_ptr<MemorySink> sink;
+        auto logger = make_logger("overwrite_oldest", 4096, sink);
+
+        for (int i = 0; i < 1000; ++i) {
+            logger->debug("record {}", i);
+        }
+        logger->error("trigger");
+        EFP_TEST_CHECK(logger->flush());
+
+        const std::vector<int> numbers = logged_numbers(sink->contents(), "record ");
+        EFP_TEST_CHECK(!numbers.empty() && numbers.size() < 1000);
+        EFP_TEST_CHECK(!numbers.empty() && numbers.back() == 999);
+        for (size_t i = 1; i < numbers.size(); ++i) {
+            EFP_TEST_CHECK(numbers[i] == numbers[i - 1] + 1);
+        }
+    }
+} // namespace
+
+int main() {
+    Logger::init();
+
+    trigger_and_dump();
+    overwrite_oldest();
+    return efp_test::result();
+}
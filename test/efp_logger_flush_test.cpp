@@ -0,0 +1,136 @@
+// Records written by a flush, and flushes which time out
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    constexpr int record_num = 1000;
+
+    // The numbers logged as "<prefix> {}", in output order
+    std::vector<int> logged_numbers(const std::string& contents, const std::string& prefix) {
+        std::vector<int> numbers;
+        std::istringstream stream(contents);
+        std::string line;
+        while (std::getline(stream, line)) {
+            const size_t pos = line.find(prefix);
+            if (pos != std::string::npos) {
+                numbers.push_back(std::stoi(line.substr(pos + prefix.size())));
+            }
+        }
+        return numbers;
+    }
+
+    bool in_order(const std::vector<int>& numbers) {
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            if (numbers[i] != static_cast<int>(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Takes a while to write each batch
+    class SlowSink : public Sink {
+    public:
+        explicit SlowSink(std::chrono::milliseconds delay)
+            : Sink(LogLevel::Trace, false), _delay(delay) {}
+
+        void write(const char* data, size_t size) override {
+            std::this_thread::sleep_for(_delay);
+            std::lock_guard<std::mutex> lock(_mutex);
+            _contents.append(data, size);
+        }
+
+        std::string contents() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _contents;
+        }
+
+    private:
+        std::chrono::milliseconds _delay;
+        mutable std::mutex _mutex;
+        std::string _contents;
+    };
+
+    // Everything logged by any thread before the flush is written when it returns, each
+    // thread in its own order. Blocking keeps every record while the backend sleeps.
+    void flush_writes_earlier_records() {
+        LoggerConfig config;
+        config.overflow_policy = OverflowPolicy::Block;
+        auto logger = Logger::create("flush_writes_earlier_records", config);
+        auto sink = std::make_shared<MemorySink>(1 << 20);
+        logger->set_sink(sink);
+
+        std::thread other([&]() {
+            for (int i = 0; i < record_num; ++i) {
+                logger->info("other {}", i);
+            }
+        });
+        for (int i = 0; i < record_num; ++i) {
+            logger->info("main {}", i);
+        }
+        other.join();
+        EFP_TEST_CHECK(logger->flush());
+
+        const std::string contents = sink->contents();
+        const std::vector<int> main_numbers = logged_numbers(contents, "main ");
+        const std::vector<int> other_numbers = logged_numbers(contents, "other ");
+        EFP_TEST_CHECK(main_numbers.size() == static_cast<size_t>(record_num));
+        EFP_TEST_CHECK(other_numbers.size() == static_cast<size_t>(record_num));
+        EFP_TEST_CHECK(in_order(main_numbers));
+        EFP_TEST_CHECK(in_order(other_numbers));
+    }
+
+    // A record at the flush level is written when the call returns
+    void flush_level() {
+        LoggerConfig config;
+        config.flush_level = LogLevel::Error;
+        config.flush_timeout = std::chrono::seconds(1);
+        auto logger = Logger::create("flush_level", config);
+        auto sink = std::make_shared<MemorySink>(1 << 16);
+        logger->set_sink(sink);
+
+        logger->info("before");
+        logger->error("flushed");
+        const std::string contents = sink->contents();
+        EFP_TEST_CHECK(contents.find("before") != std::string::npos);
+        EFP_TEST_CHECK(contents.find("flushed") != std::string::npos);
+    }
+
+    // A flush gives up after its timeout while the sink is still writing
+    void flush_timeout() {
+        auto logger = Logger::create("flush_timeout");
+        auto sink = std::make_shared<SlowSink>(std::chrono::milliseconds(500));
+        logger->set_sink(sink);
+
+        logger->info("slow");
+        const auto begin = std::chrono::steady_clock::now();
+        EFP_TEST_CHECK(!logger->flush(std::chrono::milliseconds(50)));
+        EFP_TEST_CHECK(std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(400));
+
+        EFP_TEST_CHECK(logger->flush(std::chrono::seconds(5)));
+        EFP_TEST_CHECK(sink->contents().find("slow") != std::string::npos);
+    }
+} // namespace
+
+int main() {
+    // The backend only drains when woken
+    LoggerConfig config;
+    config.poll_period = std::chrono::seconds(10);
+    Logger::init(config);
+
+    flush_writes_earlier_records();
+    flush_level();
+    flush_timeout();
+    return efp_test::result();
+}
@@ -0,0 +1,67 @@
+// Messages rendered from format strings the backend cannot take as they are
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    std::shared_ptr<NamedLogger> make_logger(const std::string& name,
+                                             std::shared_ptr<MemorySink>& sink) {
+        auto logger = Logger::create(name);
+        sink = std::make_shared<MemorySink>(1 << 16);
+        logger->set_sink(sink);
+        return logger;
+    }
+
+    bool contains(const std::string& contents, const char* str) {
+        return contents.find(str) != std::string::npos;
+    }
+
+    // A field whose spec does not suit its argument is printed as it is, and the rest of the
+    // message as usual
+    void bad_spec() {
+        std::shared_ptr<MemorySink> sink;
+        auto logger = make_logger("bad_spec", sink);
+
+        logger->info("bad spec {:d} after {}", "text", 1);
+        logger->info("bad dynamic {:{}} after {}", 2, "width", 3);
+        logger->info("good spec {:>4}", 5);
+        EFP_TEST_CHECK(logger->flush());
+
+        const std::string contents = sink->contents();
+        EFP_TEST_CHECK(contains(contents, "bad spec {:d} after 1"));
+        EFP_TEST_CHECK(contains(contents, "bad dynamic {:{}} after 3"));
+        EFP_TEST_CHECK(contains(contents, "good spec    5"));
+    }
+
+    // A format string which is not a literal may change at the same address between records
+    void reused_address() {
+        std::shared_ptr<MemorySink> sink;
+        auto logger = make_logger("reused_address", sink);
+
+        char fmt_str[32] = "first {}";
+        logger->info(fmt_str, 1);
+        EFP_TEST_CHECK(logger->flush());
+
+        std::strcpy(fmt_str, "second {:>3}");
+        logger->info(fmt_str, 2);
+        EFP_TEST_CHECK(logger->flush());
+
+        const std::string contents = sink->contents();
+        EFP_TEST_CHECK(contains(contents, "first 1"));
+        EFP_TEST_CHECK(contains(contents, "second   2"));
+    }
+} // namespace
+
+int main() {
+    Logger::init();
+
+    bad_spec();
+    reused_address();
+    return efp_test::result();
+}
@@ -0,0 +1,84 @@
+// Records of many threads printed oldest first
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    constexpr int thread_num = 16;
+    constexpr int record_num = 4000;
+
+    // The numbers logged as "record {}", in output order
+    std::vector<int> logged_numbers(const std::string& contents) {
+        std::vector<int> numbers;
+        std::istringstream stream(contents);
+        std::string line;
+        while (std::getline(stream, line)) {
+            const size_t pos = line.find("record ");
+            if (pos != std::string::npos) {
+                numbers.push_back(std::stoi(line.substr(pos + 7)));
+            }
+        }
+        return numbers;
+    }
+
+    // The threads take turns, so the numbers follow the time stamps. With the backend asleep
+    // they are taken in one snapshot and merged across every queue.
+    void merge_in_time_order() {
+        LoggerConfig config;
+        config.queue_capacity = 1 << 16;
+        config.wakeup_fill_percent = 0;
+        auto logger = Logger::create("merge_in_time_order", config);
+        auto sink = std::make_shared<MemorySink>(1 << 20);
+        logger->set_sink(sink);
+        Logger::flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+        std::atomic<int> turn{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_num; ++t) {
+            threads.emplace_back([&, t]() {
+                logger->prepare_thread();
+                for (int i = t; i < record_num; i += thread_num) {
+                    while (turn.load(std::memory_order_acquire) != i) {
+                        std::this_thread::yield();
+                    }
+                    logger->info("record {}", i);
+                    turn.store(i + 1, std::memory_order_release);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        EFP_TEST_CHECK(logger->flush());
+        EFP_TEST_CHECK(logger->dropped_count() == 0);
+
+        const std::vector<int> numbers = logged_numbers(sink->contents());
+        EFP_TEST_CHECK(numbers.size() == static_cast<size_t>(record_num));
+        bool in_order = true;
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            in_order = in_order && numbers[i] == static_cast<int>(i);
+        }
+        EFP_TEST_CHECK(in_order);
+    }
+} // namespace
+
+int main() {
+    // The backend only drains when woken
+    LoggerConfig config;
+    config.poll_period = std::chrono::seconds(10);
+    Logger::init(config);
+
+    merge_in_time_order();
+    return efp_test::result();
+}
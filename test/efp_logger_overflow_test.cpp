@@ -0,0 +1,136 @@
+// Records kept and dropped by each overflow policy
+
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    constexpr int record_num = 1000;
+    constexpr size_t queue_capacity = 1024;
+
+    // The numbers logged as "record {}", in output order
+    std::vector<int> logged_numbers(const std::string& contents) {
+        std::vector<int> numbers;
+        std::istringstream stream(contents);
+        std::string line;
+        while (std::getline(stream, line)) {
+            const size_t pos = line.find("record ");
+            if (pos != std::string::npos) {
+                numbers.push_back(std::stoi(line.substr(pos + 7)));
+            }
+        }
+        return numbers;
+    }
+
+    std::shared_ptr<NamedLogger> make_logger(const std::string& name, OverflowPolicy policy,
+                                             unsigned wakeup_fill_percent,
+                                             std::shared_ptr<MemorySink>& sink) {
+        LoggerConfig config;
+        config.queue_capacity = queue_capacity;
+        config.overflow_policy = policy;
+        config.wakeup_fill_percent = wakeup_fill_percent;
+        auto logger = Logger::create(name, config);
+        sink = std::make_shared<MemorySink>(1 << 20);
+        logger->set_sink(sink);
+        logger->prepare_thread();
+        return logger;
+    }
+
+    // With the backend asleep, so that nothing is drained while logging
+    void wait_until_backend_sleeps() {
+        Logger::flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    void drop_newest() {
+        std::shared_ptr<MemorySink> sink;
+        auto logger = make_logger("drop_newest", OverflowPolicy::DropNewest, 0, sink);
+        wait_until_backend_sleeps();
+
+        for (int i = 0; i < record_num; ++i) {
+            logger->info("record {}", i);
+        }
+        EFP_TEST_CHECK(logger->flush());
+
+        // The records which fit before the end of the ring
+        const size_t record_size = detail::record_size(&detail::ArgSignature<int>::call_site, 0);
+        const int kept = static_cast<int>(queue_capacity / record_size);
+        const LoggerStats stats = logger->stats();
+        EFP_TEST_CHECK(stats.enqueued[static_cast<size_t>(LogLevel::Info)] == static_cast<uint64_t>(kept));
+        EFP_TEST_CHECK(stats.dropped[static_cast<size_t>(LogLevel::Info)] ==
+                       static_cast<uint64_t>(record_num - kept));
+        EFP_TEST_CHECK(logger->dropped_count() == static_cast<uint64_t>(record_num - kept));
+
+        const std::vector<int> numbers = logged_numbers(sink->contents());
+        EFP_TEST_CHECK(numbers.size() == static_cast<size_t>(kept));
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            EFP_TEST_CHECK(numbers[i] == static_cast<int>(i));
+        }
+        EFP_TEST_CHECK(sink->contents().find("dropped") != std::string::npos);
+    }
+
+    void overwrite_oldest() {
+        std::shared_ptr<MemorySink> sink;
+        auto logger = make_logger("overwrite_oldest", OverflowPolicy::OverwriteOldest, 0, sink);
+        wait_until_backend_sleeps();
+
+        for (int i = 0; i < record_num; ++i) {
+            logger->info("record {}", i);
+        }
+        EFP_TEST_CHECK(logger->flush());
+
+        const LoggerStats stats = logger->stats();
+        EFP_TEST_CHECK(stats.enqueued[static_cast<size_t>(LogLevel::Info)] == record_num);
+        EFP_TEST_CHECK(stats.overwritten > 0);
+        EFP_TEST_CHECK(logger->dropped_count() == stats.overwritten);
+
+        // The newest records, in order
+        const std::vector<int> numbers = logged_numbers(sink->contents());
+        EFP_TEST_CHECK(numbers.size() + stats.overwritten == static_cast<size_t>(record_num));
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            EFP_TEST_CHECK(numbers[i] == static_cast<int>(stats.overwritten + i));
+        }
+    }
+
+    void block() {
+        std::shared_ptr<MemorySink> sink;
+        auto logger = make_logger("block", OverflowPolicy::Block, 50, sink);
+
+        for (int i = 0; i < record_num; ++i) {
+            logger->info("record {}", i);
+        }
+        // Can never fit, so it is dropped rather than waited for
+        logger->info("{}", std::string(2 * queue_capacity, 'a'));
+        EFP_TEST_CHECK(logger->flush());
+
+        const LoggerStats stats = logger->stats();
+        EFP_TEST_CHECK(stats.enqueued[static_cast<size_t>(LogLevel::Info)] == record_num);
+        EFP_TEST_CHECK(stats.dropped[static_cast<size_t>(LogLevel::Info)] == 1);
+
+        const std::vector<int> numbers = logged_numbers(sink->contents());
+        EFP_TEST_CHECK(numbers.size() == static_cast<size_t>(record_num));
+        for (size_t i = 0; i < numbers.size(); ++i) {
+            EFP_TEST_CHECK(numbers[i] == static_cast<int>(i));
+        }
+    }
+} // namespace
+
+int main() {
+    // The backend only drains when woken
+    LoggerConfig config;
+    config.poll_period = std::chrono::seconds(10);
+    Logger::init(config);
+
+    drop_newest();
+    overwrite_oldest();
+    block();
+    return efp_test::result();
+}
@@ -0,0 +1,78 @@
+// Records kept by the rate limited macros and the suppressed summary
+
+#include <chrono>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    constexpr int occurrence_num = 10;
+
+    // The numbers logged as "<prefix> {}", in output order
+    std::vector<int> logged_numbers(const std::string& contents, const std::string& prefix) {
+        std::vector<int> numbers;
+        std::istringstream stream(contents);
+        std::string line;
+        while (std::getline(stream, line)) {
+            const size_t pos = line.find(prefix);
+            if (pos != std::string::npos) {
+                numbers.push_back(std::stoi(line.substr(pos + prefix.size())));
+            }
+        }
+        return numbers;
+    }
+
+    // The backend writes its reports in its own cycle, which a flush does not wait for
+    bool wait_for_output(NamedLogger& logger, const MemorySink& sink, const char* str) {
+        for (int i = 0; i < 300; ++i) {
+            logger.flush();
+            if (sink.contents().find(str) != std::string::npos) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    void rate_limited() {
+        LoggerConfig config;
+        config.suppressed_period = std::chrono::seconds(0);
+        auto logger = Logger::create("rate_limited", config);
+        auto sink = std::make_shared<MemorySink>(1 << 16);
+        logger->set_sink(sink);
+
+        for (int i = 0; i < occurrence_num; ++i) {
+            EFP_LOGGER_EVERY_N(logger, LogLevel::Warn, 4, "every {}", i);
+            EFP_LOGGER_ONCE_EVERY(logger, LogLevel::Warn, std::chrono::hours(1), "once {}", i);
+            EFP_LOGGER_FIRST_N_THEN_EVERY(logger, LogLevel::Warn, 2, 3, "first {}", i);
+            // Below the log level, so neither logged nor counted
+            EFP_LOGGER_EVERY_N(logger, LogLevel::Debug, 2, "debug {}", i);
+        }
+        EFP_TEST_CHECK(logger->flush());
+
+        const std::string contents = sink->contents();
+        EFP_TEST_CHECK(logged_numbers(contents, "every ") == std::vector<int>({0, 4, 8}));
+        EFP_TEST_CHECK(logged_numbers(contents, "once ") == std::vector<int>({0}));
+        EFP_TEST_CHECK(logged_numbers(contents, "first ") == std::vector<int>({0, 1, 2, 5, 8}));
+        EFP_TEST_CHECK(logged_numbers(contents, "debug ").empty());
+
+        EFP_TEST_CHECK(wait_for_output(*logger, *sink, "suppressed 7 records of \"every {}\""));
+        EFP_TEST_CHECK(wait_for_output(*logger, *sink, "suppressed 9 records of \"once {}\""));
+        EFP_TEST_CHECK(wait_for_output(*logger, *sink, "suppressed 5 records of \"first {}\""));
+        EFP_TEST_CHECK(sink->contents().find("of \"debug {}\"") == std::string::npos);
+    }
+} // namespace
+
+int main() {
+    Logger::init();
+
+    rate_limited();
+    return efp_test::result();
+}
@@ -0,0 +1,160 @@
+// Records of up to the whole ring, wrapping around it
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+using namespace efp::detail;
+
+namespace {
+    inline bool fill(char* record, uint32_t size, char byte) {
+        if (record == nullptr) {
+            return false;
+        }
+        std::memset(record, byte, size);
+        std::memcpy(record, &size, sizeof(uint32_t));
+        return true;
+    }
+
+    inline bool intact(const char* record, uint32_t size, char byte) {
+        uint32_t record_size;
+        std::memcpy(&record_size, record, sizeof(uint32_t));
+        bool result = record_size == size;
+        for (uint32_t i = sizeof(uint32_t); result && i < size; ++i) {
+            result = record[i] == byte;
+        }
+        return result;
+    }
+
+    bool push(SpscByteRing& ring, uint32_t size, char byte) {
+        if (!fill(ring.try_reserve(size), size, byte)) {
+            return false;
+        }
+        ring.commit();
+        return true;
+    }
+
+    bool push_overwrite(SpscByteRing& ring, uint32_t size, char byte, size_t& overwritten) {
+        if (!fill(ring.reserve_overwrite(size, overwritten), size, byte)) {
+            return false;
+        }
+        ring.commit();
+        return true;
+    }
+
+    bool pop(SpscByteRing& ring, uint32_t size, char byte) {
+        if (ring.head() >= ring.tail()) {
+            return false;
+        }
+        const bool result = intact(ring.front(), size, byte);
+        ring.pop_front();
+        return result;
+    }
+
+    bool claim(SpscByteRing& ring, uint32_t size, char byte) {
+        std::vector<char> scratch(ring.capacity());
+        const char* record = ring.claim_front(scratch.data(), ring.tail());
+        return record != nullptr && intact(record, size, byte);
+    }
+
+    void wrap_into_empty_ring() {
+        SpscByteRing ring(8192, false);
+        EFP_TEST_CHECK(push(ring, 4032, 'a'));
+        EFP_TEST_CHECK(pop(ring, 4032, 'a'));
+
+        // Past the end from offset 4032, and the ring is empty
+        EFP_TEST_CHECK(push(ring, 5056, 'b'));
+        EFP_TEST_CHECK(pop(ring, 5056, 'b'));
+        EFP_TEST_CHECK(ring.head() == ring.tail());
+
+        EFP_TEST_CHECK(push(ring, 8192, 'c'));
+        EFP_TEST_CHECK(pop(ring, 8192, 'c'));
+        EFP_TEST_CHECK(!push(ring, 8200, 'd'));
+    }
+
+    void wrap_into_used_ring() {
+        SpscByteRing ring(8192, false);
+        EFP_TEST_CHECK(push(ring, 4032, 'a'));
+        // Would overlap the unread record
+        EFP_TEST_CHECK(!push(ring, 5056, 'b'));
+        EFP_TEST_CHECK(pop(ring, 4032, 'a'));
+        EFP_TEST_CHECK(push(ring, 5056, 'b'));
+        EFP_TEST_CHECK(pop(ring, 5056, 'b'));
+    }
+
+    void wrap_with_overwrite() {
+        SpscByteRing ring(8192, true);
+        size_t overwritten = 0;
+        EFP_TEST_CHECK(push_overwrite(ring, 4032, 'a', overwritten));
+        EFP_TEST_CHECK(push_overwrite(ring, 5056, 'b', overwritten));
+        EFP_TEST_CHECK(overwritten == 1);
+        EFP_TEST_CHECK(claim(ring, 5056, 'b'));
+        EFP_TEST_CHECK(ring.head() == ring.tail());
+
+        EFP_TEST_CHECK(!push_overwrite(ring, 8200, 'c', overwritten));
+    }
+
+    // Sizes from a fixed sequence, with up to three records in flight
+    void wrap_repeatedly() {
+        SpscByteRing ring(8192, false);
+        uint32_t state = 1;
+        uint32_t sizes[3];
+        char bytes[3];
+        size_t in_flight = 0;
+
+        for (int i = 0; i < 100000; ++i) {
+            state = state * 1664525 + 1013904223;
+            const uint32_t size = static_cast<uint32_t>(
+                (state >> 8) % (8192 / record_alignment) + 1) * record_alignment;
+            const char byte = static_cast<char>('a' + i % 26);
+
+            while (in_flight == 3 || (in_flight != 0 && !push(ring, size, byte))) {
+                EFP_TEST_CHECK(pop(ring, sizes[0], bytes[0]));
+                sizes[0] = sizes[1];
+                sizes[1] = sizes[2];
+                bytes[0] = bytes[1];
+                bytes[1] = bytes[2];
+                --in_flight;
+            }
+            if (in_flight == 0) {
+                EFP_TEST_CHECK(push(ring, size, byte));
+            }
+            sizes[in_flight] = size;
+            bytes[in_flight] = byte;
+            ++in_flight;
+        }
+    }
+
+    // Each record alone in the queue goes through, whatever the offset it starts at
+    void large_records_through_logger() {
+        LoggerConfig config;
+        config.queue_capacity = 8192;
+        Logger::init(config);
+
+        auto sink = std::make_shared<MemorySink>(1 << 16);
+        Logger::set_sink(sink);
+        Logger::flush();
+
+        info("{}", std::string(4000, 'a'));
+        EFP_TEST_CHECK(Logger::flush());
+        info("{}", std::string(5000, 'b'));
+        EFP_TEST_CHECK(Logger::flush());
+
+        EFP_TEST_CHECK(Logger::dropped_count() == 0);
+        EFP_TEST_CHECK(sink->contents().find(std::string(5000, 'b')) != std::string::npos);
+    }
+} // namespace
+
+int main() {
+    wrap_into_empty_ring();
+    wrap_into_used_ring();
+    wrap_with_overwrite();
+    wrap_repeatedly();
+    large_records_through_logger();
+    return efp_test::result();
+}
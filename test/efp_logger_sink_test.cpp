@@ -0,0 +1,141 @@
+// Output format, rotation and crash output of sinks
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace efp;
+
+namespace {
+    std::string read_file(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        std::ostringstream contents;
+        contents << file.rdbuf();
+        return contents.str();
+    }
+
+    bool is_json_line(const std::string& contents) {
+        return !contents.empty() && contents[0] == '{' &&
+               contents.find("\"message\":") != std::string::npos;
+    }
+
+    // A format set on the sink survives adding it to a logger of another format
+    void own_format_kept() {
+        auto logger = Logger::create("own_format_kept");
+        auto json = std::make_shared<MemorySink>(1 << 16);
+        json->set_format(OutputFormat::Json);
+        logger->set_sink(json);
+        auto text = std::make_shared<MemorySink>(1 << 16);
+        logger->add_sink(text);
+
+        logger->info("record {}", 1);
+        EFP_TEST_CHECK(logger->flush());
+
+        EFP_TEST_CHECK(is_json_line(json->contents()));
+        EFP_TEST_CHECK(json->contents().find("\"message\":\"record 1\"") != std::string::npos);
+        EFP_TEST_CHECK(!is_json_line(text->contents()));
+        EFP_TEST_CHECK(text->contents().find("record 1") != std::string::npos);
+    }
+
+    // The output format of the logger applies to the sinks without one of their own
+    void default_format_followed() {
+        auto logger = Logger::create("default_format_followed");
+        auto follows = std::make_shared<MemorySink>(1 << 16);
+        logger->set_sink(follows);
+        auto text = std::make_shared<MemorySink>(1 << 16);
+        text->set_format(OutputFormat::Text);
+        logger->add_sink(text);
+
+        logger->set_output_format(OutputFormat::Json);
+        logger->info("record {}", 2);
+        EFP_TEST_CHECK(logger->flush());
+
+        EFP_TEST_CHECK(is_json_line(follows->contents()));
+        EFP_TEST_CHECK(!is_json_line(text->contents()));
+        EFP_TEST_CHECK(text->contents().find("record 2") != std::string::npos);
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    // While the next file cannot be made, the output stays in the current one. Rotation goes
+    // on once it can be made again.
+    void rotating_next_file_retried() {
+        const std::string path = "efp_logger_sink_test.log";
+        const std::string next_path = path + ".next";
+        std::remove(path.c_str());
+        std::remove((path + ".1").c_str());
+        rmdir(next_path.c_str());
+        // Takes the place of the next file
+        EFP_TEST_CHECK(mkdir(next_path.c_str(), 0755) == 0);
+
+        RotatingFileConfig config;
+        config.path = path;
+        config.max_file_size = 1024;
+        config.max_files = 1;
+        config.segment_size = 4096;
+        auto sink = std::make_shared<RotatingFileSink>(config);
+        EFP_TEST_CHECK(sink->is_open());
+        auto logger = Logger::create("rotating_next_file_retried");
+        logger->set_sink(sink);
+
+        for (int i = 0; i < 100; ++i) {
+            logger->info("before {}", i);
+            EFP_TEST_CHECK(logger->flush());
+        }
+        EFP_TEST_CHECK(read_file(path).find("before 99") != std::string::npos);
+        EFP_TEST_CHECK(!std::ifstream(path + ".1").good());
+
+        EFP_TEST_CHECK(rmdir(next_path.c_str()) == 0);
+        for (int i = 0; i < 100; ++i) {
+            logger->info("after {}", i);
+            EFP_TEST_CHECK(logger->flush());
+        }
+        // The helper thread renames the files after the switch
+        const std::string contents = read_file(path + ".1") + read_file(path) + read_file(next_path);
+        EFP_TEST_CHECK(std::ifstream(path + ".1").good());
+        EFP_TEST_CHECK(contents.find("after 99") != std::string::npos);
+    }
+
+    // The crash handler writes after the last record of the current file
+    void rotating_crash_fd() {
+        const std::string path = "efp_logger_sink_test_crash.log";
+        std::remove(path.c_str());
+
+        RotatingFileConfig config;
+        config.path = path;
+        config.segment_size = 4096;
+        auto sink = std::make_shared<RotatingFileSink>(config);
+        auto logger = Logger::create("rotating_crash_fd");
+        logger->set_sink(sink);
+
+        logger->info("last record");
+        EFP_TEST_CHECK(logger->flush());
+
+        const int fd = sink->crash_fd();
+        EFP_TEST_CHECK(fd >= 0);
+        EFP_TEST_CHECK(write(fd, "crash line\n", 11) == 11);
+        EFP_TEST_CHECK(read_file(path).find("last record\ncrash line\n") != std::string::npos);
+    }
+#endif
+} // namespace
+
+int main() {
+    Logger::init();
+
+    own_format_kept();
+    default_format_followed();
+#if defined(__unix__) || defined(__APPLE__)
+    rotating_next_file_retried();
+    rotating_crash_fd();
+#endif
+    return efp_test::result();
+}
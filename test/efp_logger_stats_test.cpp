@@ -0,0 +1,100 @@
+// Counters returned by stats() and the periodic stats report
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "efp/logger.hpp"
+#include "efp_logger_test.hpp"
+
+using namespace efp;
+
+namespace {
+    constexpr size_t queue_capacity = 1 << 16;
+
+    // The backend writes its reports in its own cycle, which a flush does not wait for
+    bool wait_for_output(NamedLogger& logger, const MemorySink& sink, const char* str) {
+        for (int i = 0; i < 300; ++i) {
+            logger.flush();
+            if (sink.contents().find(str) != std::string::npos) {
+                return true;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
+    void counters() {
+        LoggerConfig config;
+        config.queue_capacity = queue_capacity;
+        auto logger = Logger::create("counters", config);
+        auto sink = std::make_shared<MemorySink>(1 << 16);
+        logger->set_sink(sink);
+
+        for (int i = 0; i < 10; ++i) {
+            logger->info("record {}", i);
+        }
+        logger->warn("warning");
+        // Below the log level, so not enqueued
+        logger->debug("debug");
+        std::thread other([&]() { logger->error("from other thread"); });
+        other.join();
+        EFP_TEST_CHECK(logger->flush());
+        // A batch is counted at the snapshot after it
+        EFP_TEST_CHECK(logger->flush());
+
+        const LoggerStats stats = logger->stats();
+        EFP_TEST_CHECK(stats.enqueued[static_cast<size_t>(LogLevel::Info)] == 10);
+        EFP_TEST_CHECK(stats.enqueued[static_cast<size_t>(LogLevel::Warn)] == 1);
+        EFP_TEST_CHECK(stats.enqueued[static_cast<size_t>(LogLevel::Error)] == 1);
+        EFP_TEST_CHECK(stats.enqueued[static_cast<size_t>(LogLevel::Debug)] == 0);
+        for (size_t level = 0; level < log_level_num; ++level) {
+            EFP_TEST_CHECK(stats.dropped[level] == 0);
+        }
+        EFP_TEST_CHECK(stats.overwritten == 0);
+
+        // The queue of the exited thread may be reclaimed already
+        EFP_TEST_CHECK(!stats.queues.empty() && stats.queues.size() <= 2);
+        bool found_main = false;
+        for (const QueueStats& queue : stats.queues) {
+            EFP_TEST_CHECK(queue.capacity == queue_capacity);
+            if (queue.thread_id == std::this_thread::get_id()) {
+                found_main = true;
+                EFP_TEST_CHECK(queue.enqueued[static_cast<size_t>(LogLevel::Info)] == 10);
+                EFP_TEST_CHECK(queue.high_water > 0 && queue.high_water <= queue_capacity);
+            }
+        }
+        EFP_TEST_CHECK(found_main);
+
+        EFP_TEST_CHECK(stats.written == 12);
+        EFP_TEST_CHECK(stats.batch_num >= 1);
+        EFP_TEST_CHECK(stats.batch_record_num == 12);
+        EFP_TEST_CHECK(stats.max_batch_size >= 1 && stats.max_batch_size <= 12);
+        EFP_TEST_CHECK(stats.max_latency_ns > 0);
+        EFP_TEST_CHECK(stats.latency_sum_ns >= stats.max_latency_ns);
+    }
+
+    // The report counts the records of the logger, not its own
+    void report() {
+        LoggerConfig config;
+        config.stats_period = std::chrono::seconds(1);
+        auto logger = Logger::create("report", config);
+        auto sink = std::make_shared<MemorySink>(1 << 16);
+        logger->set_sink(sink);
+
+        for (int i = 0; i < 5; ++i) {
+            logger->info("record {}", i);
+        }
+        EFP_TEST_CHECK(wait_for_output(*logger, *sink,
+                                       "efp logger stats: 5 enqueued, 0 dropped, 0 overwritten"));
+    }
+} // namespace
+
+int main() {
+    Logger::init();
+
+    counters();
+    report();
+    return efp_test::result();
+}
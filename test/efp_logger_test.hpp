@@ -0,0 +1,28 @@
+// Checks for the tests, which are plain executables run by ctest
+#pragma once
+
+#include <cstdio>
+
+namespace efp_test {
+    inline int& failure_num() {
+        static int num = 0;
+        return num;
+    }
+
+    inline void check(bool condition, const char* expression, const char* file, int line) {
+        if (!condition) {
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+            ++failure_num();
+        }
+    }
+
+    // The exit code of the test
+    inline int result() {
+        if (failure_num() != 0) {
+            std::fprintf(stderr, "%d checks failed\n", failure_num());
+        }
+        return failure_num() == 0 ? 0 : 1;
+    }
+} // namespace efp_test
+
+#define EFP_TEST_CHECK(condition) efp_test::check((condition), #condition, __FILE__, __LINE__)
@@ -0,0 +1,257 @@
+// Turns a binary log written with OutputFormat::Binary into the text layout of the logger.
+// Usage: efp_logger_decode <input> [output]
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "efp/logger.hpp"
+
+using namespace efp;
+using namespace efp::detail;
+
+namespace {
+    // Reads the input in fixed size chunks, so files of any size are decoded in constant memory
+    class InputStream {
+    public:
+        explicit InputStream(std::FILE* file)
+            : _file(file), _chunk(1 << 16), _pos(0), _size(0) {}
+
+        bool read(char* dst, size_t size) {
+            while (size > 0) {
+                if (_pos == _size && !refill()) {
+                    return false;
+                }
+                const size_t available = _size - _pos;
+                const size_t copy_size = size < available ? size : available;
+                std::memcpy(dst, &_chunk[_pos], copy_size);
+                _pos += copy_size;
+                dst += copy_size;
+                size -= copy_size;
+            }
+            return true;
+        }
+
+        bool read_byte(uint8_t& byte) { return read(reinterpret_cast<char*>(&byte), 1); }
+
+        bool read_varint(uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                uint8_t byte;
+                if (!read_byte(byte)) {
+                    return false;
+                }
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        bool refill() {
+            _pos = 0;
+            _size = std::fread(_chunk.data(), 1, _chunk.size(), _file);
+            return _size != 0;
+        }
+
+        std::FILE* _file;
+        std::vector<char> _chunk;
+        size_t _pos;
+        size_t _size;
+    };
+
+    struct Definition {
+        std::string fmt_str;
+        std::vector<ArgType> arg_types;
+        ParsedFormat parsed;
+    };
+
+    // Custom arguments are stored as their text, already formatted with the spec of their field
+    void format_custom_text(fmt::memory_buffer& out, const char* data, size_t size, fmt::string_view) {
+        out.append(data, data + size);
+    }
+
+    const CustomArgCodec custom_text_codec{&format_custom_text};
+
+    // Passes strings on as custom arguments, which ignore the format spec
+    struct CustomTextCollector {
+        ArgValueCollector& collector;
+
+        void operator()(fmt::string_view text) {
+            collector(CustomValue{&custom_text_codec, text.data(), static_cast<uint32_t>(text.size())});
+        }
+
+        template <typename A>
+        void operator()(const A& arg) { collector(arg); }
+    };
+
+    // The magic, or the rest of it after the first byte, then the precision
+    bool read_header(InputStream& stream, size_t magic_begin, TimeStampCache& time_stamp_cache) {
+        char magic[binary_magic_size];
+        uint8_t precision;
+        if (!stream.read(magic + magic_begin, binary_magic_size - magic_begin) ||
+            std::memcmp(magic + magic_begin, binary_magic + magic_begin,
+                        binary_magic_size - magic_begin) != 0 ||
+            !stream.read_byte(precision)) {
+            return false;
+        }
+        time_stamp_cache.set_precision(static_cast<TimePrecision>(precision));
+        return true;
+    }
+
+    int fail(const char* message) {
+        std::fprintf(stderr, "efp_logger_decode: %s\n", message);
+        return 1;
+    }
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        std::fprintf(stderr, "Usage: %s <input> [output]\n", argv[0]);
+        return 1;
+    }
+
+    std::FILE* input = std::fopen(argv[1], "rb");
+    if (!input) {
+        return fail("can not open the input file");
+    }
+
+    std::FILE* output = argc == 3 ? std::fopen(argv[2], "w") : stdout;
+    if (!output) {
+        return fail("can not open the output file");
+    }
+
+    InputStream stream{input};
+
+    TimeStampCache time_stamp_cache;
+    if (!read_header(stream, 0, time_stamp_cache)) {
+        return fail("not an efp logger binary log");
+    }
+
+    // Growing a deque keeps the definitions in place
+    std::deque<Definition> definitions;
+    std::vector<char> payload;
+    ArgValue args[256];
+    FieldValue fields[256];
+    fmt::memory_buffer out;
+    int64_t wall_ns = 0;
+
+    uint8_t tag;
+    while (stream.read_byte(tag)) {
+        if (tag == static_cast<uint8_t>(BinaryTag::Definition)) {
+            uint64_t id;
+            uint8_t arg_num;
+            if (!stream.read_varint(id) || !stream.read_byte(arg_num)) {
+                return fail("truncated definition");
+            }
+
+            Definition definition;
+            definition.arg_types.resize(arg_num);
+            if (!stream.read(reinterpret_cast<char*>(definition.arg_types.data()), arg_num)) {
+                return fail("truncated definition");
+            }
+
+            uint64_t fmt_size;
+            if (!stream.read_varint(fmt_size)) {
+                return fail("truncated definition");
+            }
+            definition.fmt_str.resize(fmt_size);
+            if (!stream.read(&definition.fmt_str[0], fmt_size)) {
+                return fail("truncated definition");
+            }
+
+            if (id >= definitions.size()) {
+                definitions.resize(id + 1);
+            }
+            definitions[id] = std::move(definition);
+            // The segments point into the format string, so it is parsed in place
+            definitions[id].parsed = parse_format(definitions[id].fmt_str);
+
+        } else if (tag == static_cast<uint8_t>(BinaryTag::Record)) {
+            uint64_t id;
+            uint8_t level;
+            uint64_t delta;
+            uint64_t size;
+            if (!stream.read_varint(id) || !stream.read_byte(level) ||
+                !stream.read_varint(delta) || !stream.read_varint(size)) {
+                return fail("truncated record");
+            }
+            if (id >= definitions.size()) {
+                return fail("record without definition");
+            }
+
+            payload.resize(size);
+            if (!stream.read(payload.data(), size)) {
+                return fail("truncated record");
+            }
+
+            wall_ns += zigzag_decode(delta);
+            const Definition& definition = definitions[id];
+
+            const fmt::string_view time_stamp = time_stamp_cache.render(wall_ns);
+            out.append(time_stamp.data(), time_stamp.data() + time_stamp.size());
+            out.push_back(' ');
+            fmt::format_to(fmt::appender(out), "{} ", log_level_cstr(static_cast<LogLevel>(level)));
+
+            ArgValueCollector collector{args, 0};
+            size_t field_num = 0;
+            const char* arg = payload.data();
+            for (ArgType arg_type : definition.arg_types) {
+                ArgValueCollector* target = &collector;
+                ArgValueCollector value_collector{nullptr, 0};
+                if (is_field(arg_type)) {
+                    FieldValue& field = fields[field_num++];
+                    field.key = decode_string(arg);
+                    value_collector.values = &field.value;
+                    target = &value_collector;
+                    arg_type = field_value_type(arg_type);
+                }
+                // C strings, custom arguments and keys are stored inline
+                if (arg_type == ArgType::Custom) {
+                    CustomTextCollector custom_collector{*target};
+                    arg = visit_arg(ArgType::StlString, arg, custom_collector);
+                } else {
+                    arg = visit_arg(arg_type == ArgType::CStr ? ArgType::StlString : arg_type, arg,
+                                    *target);
+                }
+            }
+
+            if (collector.size == 0) {
+                out.append(definition.fmt_str.data(),
+                           definition.fmt_str.data() + definition.fmt_str.size());
+            } else {
+                render_format(out, definition.parsed, definition.fmt_str, args, collector.size);
+            }
+            render_text_fields(out, fields, field_num);
+            out.push_back('\n');
+
+            if (out.size() >= (1 << 16)) {
+                std::fwrite(out.data(), 1, out.size(), output);
+                out.clear();
+            }
+
+        } else if (tag == static_cast<uint8_t>(binary_magic[0])) {
+            // The next output appended to the file
+            if (!read_header(stream, 1, time_stamp_cache)) {
+                return fail("truncated file header");
+            }
+            definitions.clear();
+            wall_ns = 0;
+
+        } else {
+            return fail("unknown entry");
+        }
+    }
+
+    std::fwrite(out.data(), 1, out.size(), output);
+
+    std::fclose(input);
+    if (output != stdout) {
+        std::fclose(output);
+    }
+
+    return 0;
+}